@@ -0,0 +1,179 @@
+/*
+ * Command parser microbenchmark: the time to split a line and find its
+ * command, for the strtok_r/strcmp parser the emulator used to have and
+ * for the token slices and hash table it has now. The line mix is the
+ * usual one (touch, cd, ls, write, cat, mkdir, append, rm, mv, rmdir),
+ * generated from a fixed seed. Both include a copy of the line into the
+ * parse buffer, as the old parser needed one.
+ *
+ *     parse [lines] [rounds]
+ *
+ * The emulator is compiled in, with its main renamed, so that the new
+ * parser is the one that ships.
+ */
+#define main fs_main
+#include "../fs_emulator.c"
+#undef main
+
+#define DEFAULT_LINES 200000
+#define DEFAULT_ROUNDS 20
+#define LINE_MAX_LEN 64
+
+/* Lines the parsers accepted and rejected, so that neither is optimized
+   away and both can be checked to agree */
+static long parsed[2];
+
+/* The old parser: strtok_r over a writable copy and a chain of strcmp */
+static void strtok_parse(char *line)
+{
+    line[strcspn(line, "\n")] = '\0';
+    char *save;
+    char *cmd = strtok_r(line, " \t", &save);
+    if (!cmd) {
+        return;
+    }
+
+    int nargs = 1, rflag = 0, text = 0;
+    if (strcmp(cmd, "ls") == 0 || strcmp(cmd, "stats") == 0 ||
+        strcmp(cmd, "sync") == 0 || strcmp(cmd, "exit") == 0) {
+        nargs = 0;
+    } else if (strcmp(cmd, "rm") == 0) {
+        rflag = 1;
+    } else if (strcmp(cmd, "mv") == 0) {
+        nargs = 2;
+    } else if (strcmp(cmd, "write") == 0 || strcmp(cmd, "append") == 0) {
+        text = 1;
+    } else if (strcmp(cmd, "cd") != 0 && strcmp(cmd, "mkdir") != 0 &&
+               strcmp(cmd, "touch") != 0 && strcmp(cmd, "rmdir") != 0 &&
+               strcmp(cmd, "cat") != 0 && strcmp(cmd, "snapshot") != 0 &&
+               strcmp(cmd, "rollback") != 0) {
+        parsed[0]++;
+        return;
+    }
+
+    char *arg = strtok_r(NULL, " \t", &save);
+    if (rflag && arg && strcmp(arg, "-r") == 0) {
+        arg = strtok_r(NULL, " \t", &save);
+    }
+    if (text) {
+        parsed[arg && strtok_r(NULL, "", &save)]++;
+        return;
+    }
+    for (int i = 1; i < nargs && arg; i++) {
+        arg = strtok_r(NULL, " \t", &save);
+    }
+    int ok = nargs == 0 ? !arg : arg && !strtok_r(NULL, " \t", &save);
+    parsed[ok]++;
+}
+
+/* The emulator's parser, up to the point where run_command would call
+   the handler */
+static void table_parse(const char *line, size_t len)
+{
+    const char *nl = memchr(line, '\n', len);
+    const char *pos = line, *end = nl ? nl : line + len;
+    Token cmd;
+    if (!next_token(&pos, end, &cmd)) {
+        return;
+    }
+
+    const Command *c = command_find(&cmd);
+    CmdArgs a;
+    memset(&a, 0, sizeof(a));
+    parsed[c && command_args(c, pos, end, &a)]++;
+}
+
+static void make_line(char *buf, unsigned *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    int r = (int)((*seed >> 16) % 100);
+    int n = (int)(*seed % 100000);
+
+    if (r < 30) {
+        snprintf(buf, LINE_MAX_LEN, "touch f%d\n", n);
+    } else if (r < 45) {
+        snprintf(buf, LINE_MAX_LEN, "cd d%d\n", n);
+    } else if (r < 55) {
+        snprintf(buf, LINE_MAX_LEN, "ls\n");
+    } else if (r < 65) {
+        snprintf(buf, LINE_MAX_LEN, "write f%d some text here\n", n);
+    } else if (r < 75) {
+        snprintf(buf, LINE_MAX_LEN, "cat f%d\n", n);
+    } else if (r < 85) {
+        snprintf(buf, LINE_MAX_LEN, "mkdir d%d\n", n);
+    } else if (r < 90) {
+        snprintf(buf, LINE_MAX_LEN, "append f%d more\n", n);
+    } else if (r < 95) {
+        snprintf(buf, LINE_MAX_LEN, "rm f%d\n", n);
+    } else if (r < 98) {
+        snprintf(buf, LINE_MAX_LEN, "mv f%d g%d\n", n, n / 7);
+    } else {
+        snprintf(buf, LINE_MAX_LEN, "rmdir d%d\n", n);
+    }
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_LINES;
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    if (n == 0 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [lines] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    char (*lines)[LINE_MAX_LEN] = malloc(n * LINE_MAX_LEN);
+    size_t *lens = malloc(n * sizeof(size_t));
+    if (!lines || !lens) {
+        die("parse: out of memory");
+    }
+    unsigned seed = 1;
+    for (size_t i = 0; i < n; i++) {
+        make_line(lines[i], &seed);
+        lens[i] = strlen(lines[i]);
+    }
+
+    char buf[LINE_MAX_LEN];
+    long counts[2][2];
+    double secs[2];
+
+    double t0 = now();
+    for (int k = 0; k < rounds; k++) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(buf, lines[i], lens[i] + 1);
+            strtok_parse(buf);
+        }
+    }
+    double t1 = now();
+    memcpy(counts[0], parsed, sizeof(parsed));
+    memset(parsed, 0, sizeof(parsed));
+
+    for (int k = 0; k < rounds; k++) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(buf, lines[i], lens[i] + 1);
+            table_parse(buf, lens[i]);
+        }
+    }
+    double t2 = now();
+    memcpy(counts[1], parsed, sizeof(parsed));
+
+    secs[0] = t1 - t0;
+    secs[1] = t2 - t1;
+    double per = 1e9 / ((double)n * rounds);
+    printf("%zu lines x %d: strtok/strcmp %.1f ns/line, tokens+table %.1f ns/line\n",
+           n, rounds, secs[0] * per, secs[1] * per);
+
+    free(lines);
+    free(lens);
+    if (memcmp(counts[0], counts[1], sizeof(counts[0])) != 0) {
+        fprintf(stderr, "parsers disagree: %ld/%ld accepted\n", counts[0][1], counts[1][1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Server stress driver: N clients connect to a running fs_emulator
+ * server at once, each working in its own directory, and the run reports
+ * commands per second. Every client sends its whole script, then reads
+ * the replies until the server closes the connection after "exit".
+ *
+ *     stress <socket> [clients] [commands per client]
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_COMMANDS 2000
+
+/* Each client names files and directories from this many numbers */
+#define NAMES 20
+
+typedef struct {
+    const char *path;
+    int id;
+    int commands;
+    size_t replied;
+    int ok;
+} Client;
+
+static pthread_barrier_t start;
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/* Append a formatted command to a growing script */
+static void add(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void add(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+{
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            die("vsnprintf");
+        }
+        if ((size_t)n < *cap - *len) {
+            *len += (size_t)n;
+            return;
+        }
+        *cap = *cap * 2 + (size_t)n;
+        *buf = realloc(*buf, *cap);
+        if (!*buf) {
+            die("realloc");
+        }
+    }
+}
+
+/* The client's script: a mix of every command kind, all in its own
+   directory except for the odd trip through the root */
+static char *make_script(int id, int commands, size_t *len)
+{
+    size_t cap = 4096;
+    char *buf = malloc(cap);
+    if (!buf) {
+        die("malloc");
+    }
+    *len = 0;
+
+    unsigned seed = (unsigned)id * 2654435761u + 1;
+    add(&buf, len, &cap, "mkdir c%d\ncd c%d\n", id, id);
+    for (int i = 0; i < commands; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int r = (int)((seed >> 16) % 100);
+        int n = (int)((seed >> 8) % NAMES);
+
+        if (r < 30) {
+            add(&buf, len, &cap, "touch f%d\n", n);
+        } else if (r < 45) {
+            add(&buf, len, &cap, "write f%d hello %d\n", n, i);
+        } else if (r < 55) {
+            add(&buf, len, &cap, "append f%d more %d\n", n, i);
+        } else if (r < 65) {
+            add(&buf, len, &cap, "cat f%d\n", n);
+        } else if (r < 75) {
+            add(&buf, len, &cap, "rm f%d\n", n);
+        } else if (r < 80) {
+            add(&buf, len, &cap, "mkdir d%d\n", n);
+        } else if (r < 85) {
+            add(&buf, len, &cap, "rmdir d%d\n", n);
+        } else if (r < 95) {
+            add(&buf, len, &cap, "ls\n");
+        } else {
+            add(&buf, len, &cap, "cd ..\ncd c%d\n", id);
+        }
+    }
+    add(&buf, len, &cap, "exit\n");
+    return buf;
+}
+
+static void *client_main(void *arg)
+{
+    Client *c = arg;
+    size_t len;
+    char *script = make_script(c->id, c->commands, &len);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", c->path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        die(c->path);
+    }
+
+    pthread_barrier_wait(&start);
+
+    /* The server reads while it runs commands and never blocks on its
+       replies, so the whole script can be sent before reading */
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(fd, script + off, len - off, MSG_NOSIGNAL);
+        if (n <= 0) {
+            die("send");
+        }
+        off += (size_t)n;
+    }
+
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        c->replied += (size_t)n;
+    }
+    c->ok = n == 0;
+
+    close(fd);
+    free(script);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s <socket> [clients] [commands per client]\n", argv[0]);
+        return 1;
+    }
+    int nclients = argc > 2 ? atoi(argv[2]) : DEFAULT_CLIENTS;
+    int commands = argc > 3 ? atoi(argv[3]) : DEFAULT_COMMANDS;
+    if (nclients < 1 || commands < 1) {
+        fprintf(stderr, "%s: clients and commands must be positive\n", argv[0]);
+        return 1;
+    }
+
+    Client *clients = calloc((size_t)nclients, sizeof(Client));
+    pthread_t *tids = calloc((size_t)nclients, sizeof(pthread_t));
+    if (!clients || !tids) {
+        die("calloc");
+    }
+    pthread_barrier_init(&start, NULL, (unsigned)nclients + 1);
+
+    for (int i = 0; i < nclients; i++) {
+        clients[i].path = argv[1];
+        clients[i].id = i;
+        clients[i].commands = commands;
+        if (pthread_create(&tids[i], NULL, client_main, &clients[i]) != 0) {
+            die("pthread_create");
+        }
+    }
+
+    struct timespec t0, t1;
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int failed = 0;
+    size_t replied = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(tids[i], NULL);
+        failed += !clients[i].ok;
+        replied += clients[i].replied;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    long total = (long)nclients * commands;
+    printf("%d clients, %ld commands in %.3f s: %.0f commands/s, %zu reply bytes\n",
+           nclients, total, secs, (double)total / secs, replied);
+
+    free(clients);
+    free(tids);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Server throughput against its thread count. For each of 1, 2, 4 and 8
+# threads, start a server on a fresh copy of fs/ and run bench/stress
+# with $CLIENTS clients of $COMMANDS commands each. Arguments are passed
+# to the server, e.g. "--durability command".
+set -e
+cd "$(dirname "$0")/.."
+
+CLIENTS=${CLIENTS:-8}
+COMMANDS=${COMMANDS:-2000}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for threads in 1 2 4 8; do
+    rm -rf "$tmp/fs"
+    cp -r fs "$tmp/fs"
+    ./fs_emulator "$@" --server "$tmp/sock" --threads "$threads" "$tmp/fs" &
+    server=$!
+    while [ ! -S "$tmp/sock" ]; do
+        sleep 0.1
+    done
+
+    printf '%d threads: ' "$threads"
+    ./bench/stress "$tmp/sock" "$CLIENTS" "$COMMANDS"
+
+    kill -INT "$server"
+    wait "$server"
+done
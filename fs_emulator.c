@@ -1,377 +1,7121 @@
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <sys/stat.h>
-#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+/* Inode numbers are 32-bit; every value but DIRENT_TOMBSTONE is usable */
+#define MAX_INODES UINT32_MAX
+
+/* Longest entry name, and the name field of a legacy directory record */
+#define NAME_LEN 255
+#define DIRENT_NAME_LEN 32
+
+/* Longest snapshot name */
+#define SNAP_NAME_LEN 32
+
+/* Inode number stored in a directory entry that has been removed */
+#define DIRENT_TOMBSTONE UINT32_MAX
+
+/* A directory is compacted once it has at least this many entries and
+   more than half of them are tombstones */
+#define COMPACT_MIN_ENTRIES 16
+
+/* rm -r unlinks host files on worker threads once a subtree is this big */
+#define RM_PARALLEL_MIN 512
+#define RM_MAX_THREADS 8
+
+/* File contents live in the "data" file, allocated in blocks of this size */
+#define DATA_BLOCK_SIZE 4096
+
+/* Reads of file contents are issued in chunks of up to this many bytes */
+#define IO_CHUNK (1u << 20)
+
+/* Server clients may not send a command line longer than this */
+#define SERVER_MAX_LINE (1u << 20)
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_THREADS 1024
+
+/* cat sends file contents straight to a server client's socket, waiting
+   at most this long in all per command for the client to read; the rest
+   is buffered like other output */
+#define SERVER_SEND_WAIT_MS 1000
+
+/* The REPL reads its input in blocks of this size; a longer line grows
+   the buffer */
+#define INPUT_BLOCK (1u << 16)
+
+/* Inodes share this many reader-writer locks, picked by inode number */
+#define LOCK_STRIPES 256
+
+/* Sets of inodes are two-level bitmaps: a top table with a slot for
+   each page of 2^INODE_PAGE_SHIFT inodes, and a page allocated only once
+   one of its inodes is added, so memory follows the inodes in use rather
+   than the largest inode number */
+#define INODE_PAGE_SHIFT 16
+#define INODE_PAGE_WORDS ((1u << INODE_PAGE_SHIFT) / 64)
+#define INODE_PAGES (1u << (32 - INODE_PAGE_SHIFT))
+
+/* Inode numbers are claimed in 64-bit words of the used bitmap */
+#define INODE_WORDS (INODE_PAGES * INODE_PAGE_WORDS)
+
+/* Each allocating thread starts its search this many words after the
+   previous one, so concurrent creates claim bits in different words */
+#define ALLOC_SPREAD_WORDS 4
+
+/* With --writeback, the flusher waits this long after the first change so
+   that later ones are written out together */
+#define WRITEBACK_DELAY_MS 50
+
+/* Buckets of the table of host-file operations waiting for write-back */
+#define PENDING_BUCKETS 256
+
+/* Buckets of the table of directories sessions are in */
+#define CWD_PIN_BUCKETS 64
+
+/* Inode file operations go to io_uring at most this many per submission,
+   each on its own registered descriptor slot and with up to five entries
+   (open, write, sync, close, rename). The kernel rounds the ring up to a
+   power of two, so room for eight is asked for. */
+#define RING_FILES 32
+#define RING_SQES (RING_FILES * 8)
+
+/* Default memory budget of the directory cache (--dir-cache), in MiB */
+#define DIR_CACHE_MB 64
+
+/* Dir structures, and directory buffers of up to SLAB_MAX_ENTS records,
+   are carved out of SLAB_CHUNK-byte chunks instead of being allocated
+   one by one. Buffers come in SLAB_CLASSES power-of-two capacities from
+   two records up; bigger ones are malloc'd. */
+#define SLAB_CHUNK (64u * 1024)
+#define SLAB_MAX_ENTS 64
+#define SLAB_CLASSES 6
+
+/* Entry names are interned: numbered records in pages of
+   1 << NAME_PAGE_SHIFT, up to NAME_PAGES pages. Numbers NAME_DOT and
+   NAME_DOTDOT are "." and "..", which stay interned. */
+#define NAME_PAGE_SHIFT 12
+#define NAME_PAGES (1u << 16)
+#define NAME_NONE UINT32_MAX
+#define NAME_DOT 0
+#define NAME_DOTDOT 1
+
+/* Names shorter than this many bytes are kept in their pool record;
+   longer ones are malloc'd */
+#define NAME_INLINE 24
+
+/* A lookup without the lock follows a hash chain at most this far */
+#define NAME_GUESS_STEPS 8
+
+/* At most this many directories keep their file open between writes */
+#define DIR_FDS_MAX 256
+
+/* Once the journal has grown past this size, the next commit checkpoints:
+   all metadata files are written out and the journal starts over, which
+   bounds the work replay has to do at startup */
+#define WAL_CHECKPOINT_BYTES (1u << 20)
+
+/* Version 2 of inodes_list starts with this magic, the version, the
+   number of chunks, the number of inodes and a CRC32C of the chunks.
+   A chunk is a run of words of the used bitmap within one page: the
+   number of its first word, the word count, then those words of the used
+   and of the directory bitmap. Version 1 is a list of 5-byte records
+   (inode number, type). */
+#define ILIST_MAGIC "FSINODES"
+#define ILIST_HEADER 32
+
+/* The "checksums" file: this magic, the number of directories, a CRC32C
+   of the rest, the inode list's CRC32C, then an (inode, CRC32C) pair for
+   each directory file in inode order */
+#define SUMS_MAGIC "FSCSUM01"
+#define SUMS_HEADER 20
+
+/* A directory file starts with DIR_MAGIC, then holds a record per entry:
+   the inode number, a name length byte and the name, zero-padded to a
+   multiple of DIR_ALIGN bytes. A file without the magic is in the
+   legacy format, an array of DirEnt. */
+#define DIR_MAGIC "FSDIR002"
+#define DIR_HEADER 8
+#define DIR_ALIGN 8
+#define DIR_REC_HEAD 5
+
+/* The journal starts with this magic and its 64-bit generation. The
+   second magic says the files may hold changes the journal does not
+   cover, so the tree is swept once the journal has been replayed. */
+#define WAL_MAGIC "FSJRNL01"
+#define WAL_SWEEP_MAGIC "FSJRNL0S"
+#define WAL_HEADER 16
+
+/* A legacy directory record: inode number + name, cut to 32 bytes */
+typedef struct {
+    uint32_t inode;
+    char name[DIRENT_NAME_LEN];
+} DirEnt;
+
+_Static_assert(sizeof(DirEnt) == sizeof(uint32_t) + DIRENT_NAME_LEN, "DirEnt is padded");
+
+/* A directory entry in memory: the name is an interned name's number,
+   off where the record starts in the directory's file */
+typedef struct {
+    uint32_t inode;
+    uint32_t name;
+    uint32_t off;
+} DirLink;
+
+/* In-memory copy of a directory file, one DirLink per record. Records
+   before index clean are in the file, and end at byte clean_bytes; bytes
+   is where they all end. Of those, the ndirty listed in dirty changed in
+   place since the file was written. rewrite means the whole file must be
+   replaced; a file with a torn last record is replaced on its first
+   change, as is one that changes format. legacy is the format of the
+   file and of the offsets. */
+typedef struct Dir {
+    uint32_t inode;
+    DirLink *ents;
+    size_t n, cap;
+    size_t dead;
+    size_t clean;
+    size_t bytes, clean_bytes;
+    uint32_t *dirty;
+    size_t ndirty, dirty_cap;
+    int rewrite;
+    int legacy, torn;
+    int fd;         /* open for writing, or -1 */
+    int ref;        /* used since the clock hand last passed; dcache_lock */
+    size_t charged; /* bytes counted in dcache_bytes */
+    struct Dir *next;
+} Dir;
+
+/* Host-file work queued for an inode in write-back mode */
+enum { OP_NONE, OP_CREATE_FILE, OP_UNLINK };
+
+typedef struct PendingOp {
+    uint32_t inode;
+    int op;
+    char *name;  /* contents of a created file's host file, malloc'd */
+    struct PendingOp *next;
+} PendingOp;
+
+/* One write to an inode file: write at off (IO_WRITE), write a temp
+   file and rename it over the inode file (IO_REPLACE), or delete it.
+   An IO_WRITE with fd set writes through that descriptor instead of
+   opening the file. */
+enum { IO_WRITE, IO_REPLACE, IO_UNLINK };
+
+typedef struct {
+    int kind;
+    uint32_t inode;
+    int fd;
+    int flags;      /* open flags */
+    off_t off;
+    char *buf;
+    size_t len;
+    char path[16], tmp[24];
+    int res;        /* 0 or negative errno once run */
+} IoOp;
+
+/* Inode file operations submitted together */
+typedef struct {
+    IoOp *ops;
+    size_t n, cap;
+    int linked;     /* stop at the first failure */
+    int detached;   /* runs after the caller's locks are dropped */
+} IoBatch;
+
+/* A directory some session is in. Removing the directory marks its pin,
+   so the session notices even once the inode number has been reused. */
+typedef struct CwdPin {
+    uint32_t inode;
+    uint32_t refs;
+    atomic_int removed;
+    struct CwdPin *next;
+} CwdPin;
+
+/* Per-user command state: the REPL has one, server mode one per client.
+   pin is the session's reference on cwd, NULL for the root.
+   cat may bypass out and write file contents straight to a descriptor:
+   drain passes on everything printed to out so far and returns that
+   descriptor (or -1), and wait_out waits until it takes more (returning 0
+   to give up). Without drain, out is flushed and its own descriptor used. */
+typedef struct Session {
+    uint32_t cwd;
+    CwdPin *pin;
+    FILE *out;
+    FILE *err;
+    int (*drain)(struct Session *s);
+    int (*wait_out)(struct Session *s);
+} Session;
+
+/* A run of contiguous blocks in the data region */
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} Extent;
+
+/* Maps a file inode's bytes onto extents of the data region */
+typedef struct FileMap {
+    uint32_t inode;
+    uint64_t size;
+    Extent *ext;
+    uint32_t n, cap;
+    pthread_rwlock_t lock;  /* guards size and ext against concurrent I/O */
+    struct FileMap *next;
+} FileMap;
+
+/* A set of inodes (see INODE_PAGE_SHIFT). Words change atomically and
+   pages are installed with compare-and-swap, so a set is read and
+   updated without a lock; pages are only freed by iset_clear. */
+typedef _Atomic uint64_t InodeWord;
+
+typedef struct {
+    _Atomic(InodeWord *) *pages;    /* INODE_PAGES slots */
+} InodeSet;
+
+/* Which inodes are in use; bits are claimed and released atomically, so
+   allocation needs no lock */
+static _Atomic(InodeWord *) inode_used_pages[INODE_PAGES];
+static InodeSet inode_used_set = { inode_used_pages };
+
+/* Which inodes in use are directories; the rest are files */
+static _Atomic(InodeWord *) inode_dir_pages[INODE_PAGES];
+static InodeSet inode_dir_set = { inode_dir_pages };
+
+/* Each thread's home word in the used bitmap (-1: not yet assigned), the
+   word its next allocation search starts at, and how many threads have
+   been given a home */
+static _Thread_local int64_t alloc_home = -1;
+static _Thread_local uint32_t alloc_hint;
+static atomic_uint alloc_threads;
+
+/* Hash table of file maps keyed by inode; files without one keep their
+   contents in their own inode file */
+static FileMap **filemaps;
+static size_t filemap_buckets, filemap_count;
+
+/* Allocation bitmap of the data region, one bit per block */
+static uint8_t *block_bitmap;
+static uint32_t data_blocks;
+static uint32_t block_rover;
+static int data_fd = -1;
+static pthread_once_t data_once = PTHREAD_ONCE_INIT;
+
+/* Directories in memory, keyed by inode number. Their memory is held
+   to dcache_budget bytes (0: no limit) by evicting directories not used
+   since the clock hand, which sweeps the buckets, last passed them. */
+static Dir **dcache;
+static size_t dcache_buckets, dcache_count;
+static size_t dcache_hand;
+static size_t dcache_budget = (size_t)DIR_CACHE_MB << 20;
+static atomic_size_t dcache_bytes;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Slab free lists, one per buffer class plus one for Dir structures,
+   and every chunk handed out so far */
+typedef struct SlabObj {
+    struct SlabObj *next;
+} SlabObj;
+
+typedef struct SlabChunk {
+    struct SlabChunk *next;
+    max_align_t align;
+} SlabChunk;
+
+static SlabObj *slab_free[SLAB_CLASSES + 1];
+static SlabChunk *slab_chunks;
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The name pool. A record counts the directory entries that use it, and
+   its number is reused once none are left; so a record's text does not
+   change while an entry holds it, and is read without a lock. Interning,
+   the hash chains, the free list and dropping a record's last reference
+   are guarded by names_lock, which is taken last; other references are
+   dropped with an atomic decrement. Lookups follow the chains without
+   the lock, and a table the pool outgrows is kept until the pool is
+   reset, for lookups still in it. */
+typedef struct {
+    atomic_uint refs;
+    _Atomic uint32_t hash;
+    _Atomic uint32_t next;  /* next in its hash chain, or in the free list */
+    uint8_t len;
+    char *name;             /* inline_name, or malloc'd */
+    char inline_name[NAME_INLINE];
+} NameRec;
+
+typedef struct NameTable {
+    struct NameTable *old;  /* the table this one replaced */
+    size_t buckets;
+    _Atomic uint32_t heads[];
+} NameTable;
+
+static NameRec *name_pages[NAME_PAGES];
+static _Atomic(NameTable *) name_table;
+static size_t name_count;
+static uint32_t name_next, name_free = NAME_NONE;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write-back state: whether it is on, the directories that became dirty
+   and the host-file operations waiting for the flusher thread */
+static int writeback;
+static uint32_t *wb_dirs;
+static size_t wb_ndirs, wb_dirs_cap;
+static PendingOp *wb_ops[PENDING_BUCKETS];
+
+/* Pins of the directories sessions are in, by inode number; a removed
+   directory's pin stays until its last session leaves it */
+static CwdPin *cwd_pins[CWD_PIN_BUCKETS];
+static atomic_size_t cwd_pin_count;
+static pthread_mutex_t cwd_pin_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wb_stop, wb_running;
+static pthread_t wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+
+/* --durability: none leaves syncing to the kernel; interval makes every
+   change durable within WRITEBACK_DELAY_MS, one group commit for all
+   changes in the interval; command makes each command durable before
+   it returns. Both durable modes queue changes like --writeback and
+   commit them through the journal. */
+enum { DUR_NONE, DUR_INTERVAL, DUR_COMMAND };
+static int durability;
+static int root_fd = -1;
+
+/* Set when the data file or the latest snapshot's directory has changed
+   since the last barrier synced it */
+static atomic_int data_unsynced, snap_unsynced;
+
+/* Set when in-memory state differs from what was last committed */
+static atomic_int state_dirty;
+
+/* FS_EMULATOR_CRASH=<point>[:<n>] kills the process right after the
+   n-th commit stage of that name, for testing crash recovery */
+static const char *crash_point;
+static int crash_countdown;
+
+/* Redo journal of the durable modes. Each record holds the state a
+   change leaves behind (an inode created or freed, a directory slot, a
+   whole directory, a file map), so replaying one twice does no harm. A
+   record is a type byte, a 32-bit payload length and the payload; a
+   commit record with the generation and a checksum of the records before
+   it closes each group. */
+enum { WAL_FILE = 1, WAL_DIR, WAL_DIRENT, WAL_FREE, WAL_EXTENTS, WAL_COMMIT };
+
+/* Journal state: the file, its generation (bumped by every checkpoint)
+   and length, and the records gathered since the last commit. wal_on is
+   set once startup replay is done; wal_lost once a record could not be
+   kept, after which only a checkpoint makes the changes durable.
+   wal_sweep keeps the sweep magic in the header until recover_tree has
+   run. */
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} WalBuf;
+
+static int wal_fd = -1;
+static int wal_on, wal_lost, wal_sweep;
+static uint64_t wal_gen;
+static off_t wal_size;
+static WalBuf wal_group;
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Records a thread holds back while wal_staging is set, until it knows
+   whether the change they describe happened */
+static _Thread_local WalBuf wal_stage;
+static _Thread_local int wal_staging, wal_stage_lost;
+
+/* Blocks freed since the last commit. They are reused only once the
+   journal says they are free, so a lost commit cannot leave a file
+   pointing at another file's data. Guarded by data_lock. */
+static Extent *wal_freed;
+static size_t wal_nfreed, wal_freed_cap;
+
+/* Snapshots live in snapshots/<name>, listed oldest first in
+   snapshots/.order. A snapshot links the inode list and extent table of
+   its time, and gets a link to each inode file the first time the live
+   file is about to change; a file still unchanged when the next snapshot
+   is taken is found there instead. snap_pending holds the inodes whose
+   file the latest snapshot still shares with the live tree: such a file
+   is replaced, never changed in place. Data blocks any snapshot refers
+   to are pinned in snap_blocks (guarded by data_lock) and not reused. */
+static char (*snap_names)[SNAP_NAME_LEN + 1];
+static size_t snap_count;
+static _Atomic(InodeWord *) snap_pending_pages[INODE_PAGES];
+static InodeSet snap_pending = { snap_pending_pages };
+static uint8_t *snap_blocks;
+static uint32_t snap_nblocks;
+
+/* Format inodes_list is written in: the one it was found in, unless
+   --inodes-list asks for the other (0 until one is known) */
+static int ilist_version;
+
+/* Format directory files are written in: each one's own, unless
+   --dir-format asks for v1 (legacy) or v2 (0 keeps it). New directories
+   are v2 unless v1 is asked for. */
+static int dir_version;
+
+/* Checksums of the inode list and the directory files as they were at
+   the last save, loaded from (and saved to) the "checksums" file. A
+   directory is checked against its sum when it is first read; sums of
+   directories written since stay stale until the next save replaces
+   the table, which only happens with the namespace lock held
+   exclusively. sums_on_disk is cleared, and the file deleted, before
+   the first write that makes the file out of date. A directory without
+   a sum gets one once it has been read: the save takes it from the cache,
+   or from sums_noted if it was evicted before, in order of eviction. */
+typedef struct {
+    uint32_t inode;
+    uint32_t sum;
+} DirSum;
+
+typedef struct {
+    DirSum ds;
+    size_t seq;
+} SumNote;
+
+static DirSum *dir_sums;
+static size_t dir_nsums;
+static SumNote *sums_noted;
+static size_t sums_nnoted, sums_noted_cap;
+static uint32_t ilist_sum;
+static int ilist_sum_known;
+static atomic_int sums_on_disk;
+
+/* Set by --uring: do inode file I/O through io_uring where available */
+static int use_uring;
+
+/* Batch collecting the calling thread's inode file operations, if any */
+static _Thread_local IoBatch *io_batch;
+
+/* Counters reported by the stats command */
+static struct {
+    _Atomic uint64_t cat_calls;
+    _Atomic uint64_t cat_bytes;
+    _Atomic uint64_t cat_zero_copy_bytes;
+    _Atomic uint64_t cat_ns;
+    _Atomic uint64_t dir_evictions;
+} stats;
+
+/*
+ * Locking. Every command holds ns_lock shared, except the few that
+ * restructure the tree (rm -r, mv) or write out all metadata, which hold
+ * it exclusively. Under it, a directory's entries (and the type bits of
+ * its children) are guarded by the directory's stripe lock:
+ * shared for lookups, exclusive for changes. At most two stripe locks are
+ * held at once, always taken in stripe order. File contents have their
+ * own lock in FileMap, taken last. Inode allocation is lock-free; data_lock
+ * guards the file map table and block allocator, dcache_lock the table
+ * of cached directories, wb_lock the write-back queues and wal_lock the
+ * journal records not yet committed.
+ */
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t inode_locks[LOCK_STRIPES];
+static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void locks_init(void)
+{
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+static void ns_enter(int exclusive)
+{
+    if (exclusive) {
+        pthread_rwlock_wrlock(&ns_lock);
+    } else {
+        pthread_rwlock_rdlock(&ns_lock);
+    }
+}
+
+static void ns_leave(void)
+{
+    pthread_rwlock_unlock(&ns_lock);
+}
+
+static void lock_inode(uint32_t inode, int exclusive)
+{
+    if (exclusive) {
+        pthread_rwlock_wrlock(&inode_locks[inode % LOCK_STRIPES]);
+    } else {
+        pthread_rwlock_rdlock(&inode_locks[inode % LOCK_STRIPES]);
+    }
+}
+
+static void unlock_inode(uint32_t inode)
+{
+    pthread_rwlock_unlock(&inode_locks[inode % LOCK_STRIPES]);
+}
+
+/* Lock two inodes exclusively in stripe order (once if they share one) */
+static void lock_inode_pair(uint32_t a, uint32_t b)
+{
+    uint32_t sa = a % LOCK_STRIPES, sb = b % LOCK_STRIPES;
+
+    lock_inode(sa < sb ? a : b, 1);
+    if (sa != sb) {
+        lock_inode(sa < sb ? b : a, 1);
+    }
+}
+
+static void unlock_inode_pair(uint32_t a, uint32_t b)
+{
+    unlock_inode(a);
+    if (a % LOCK_STRIPES != b % LOCK_STRIPES) {
+        unlock_inode(b);
+    }
+}
+
+/* Note that there is something to commit, waking the flusher if it is
+   waiting for that */
+static void mark_dirty(void)
+{
+    if (atomic_exchange(&state_dirty, 1) || !wb_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&wb_lock);
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* Stop here if FS_EMULATOR_CRASH names this commit stage */
+static void crash_hook(const char *stage)
+{
+    if (crash_point && strcmp(crash_point, stage) == 0 && --crash_countdown == 0) {
+        fprintf(stderr, "crash injected after %s\n", stage);
+        _exit(99);
+    }
+}
+
+/* In the durable modes, flush a file's data to disk. Returns 0 on
+   failure with errno set. */
+static int durable_sync(int fd)
+{
+    return durability == DUR_NONE || fdatasync(fd) == 0;
+}
+
+/* Flush and close a stdio file, syncing it first in the durable modes */
+static int durable_close(FILE *f)
+{
+    int ok = fflush(f) == 0 && durable_sync(fileno(f));
+    return fclose(f) == 0 && ok;
+}
+
+/* Sync a host directory, making the names created, renamed or removed in
+   it durable */
+static void durable_sync_dir(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0) {
+        perror(path);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* Sync the data file if file contents were written since it last was */
+static void durable_sync_data(void)
+{
+    if (atomic_exchange(&data_unsynced, 0) && fdatasync(data_fd) != 0) {
+        perror("data");
+    }
+}
+
+/* Make everything written so far durable before the next commit stage.
+   Each file is synced by whoever wrote it, so what is left is the data
+   file and the directories: the file system's own, and the snapshot's
+   if links were added to it. */
+static void durable_barrier(const char *stage)
+{
+    if (durability != DUR_NONE) {
+        durable_sync_data();
+        if (atomic_exchange(&snap_unsynced, 0) && snap_count > 0) {
+            char dir[64];
+            snprintf(dir, sizeof(dir), "snapshots/%s", snap_names[snap_count - 1]);
+            durable_sync_dir(dir);
+            durable_sync_dir("snapshots");
+        }
+        if (fsync(root_fd) != 0) {
+            perror("fsync");
+        }
+    }
+    crash_hook(stage);
+}
+
+/* Print an error message and exit */
+static void die(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+/* A set with no members; NULL if it cannot be allocated */
+static InodeSet *iset_new(void)
+{
+    InodeSet *set = malloc(sizeof(*set));
+    if (set) {
+        set->pages = calloc(INODE_PAGES, sizeof(*set->pages));
+        if (!set->pages) {
+            free(set);
+            return NULL;
+        }
+    }
+    return set;
+}
+
+/* The word holding an inode's bit. A missing page is allocated if create
+   is set; otherwise (or if that fails) the result is NULL. */
+static InodeWord *iset_word(InodeSet *set, uint32_t inode, int create)
+{
+    _Atomic(InodeWord *) *slot = &set->pages[inode >> INODE_PAGE_SHIFT];
+    InodeWord *page = atomic_load(slot);
+
+    if (!page && create) {
+        InodeWord *fresh = calloc(INODE_PAGE_WORDS, sizeof(InodeWord));
+        if (!fresh) {
+            return NULL;
+        }
+        /* Another thread may install the page first; use that one */
+        if (atomic_compare_exchange_strong(slot, &page, fresh)) {
+            page = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+    return page ? &page[(inode / 64) % INODE_PAGE_WORDS] : NULL;
+}
+
+static int iset_has(InodeSet *set, uint32_t inode)
+{
+    InodeWord *word = iset_word(set, inode, 0);
+    return word && (atomic_load(word) >> (inode % 64)) & 1;
+}
+
+/* Add or remove an inode; adding dies if a page cannot be allocated */
+static void iset_put(InodeSet *set, uint32_t inode, int in)
+{
+    uint64_t bit = (uint64_t)1 << (inode % 64);
+    InodeWord *word = iset_word(set, inode, in);
+
+    if (in) {
+        if (!word) {
+            die("out of memory");
+        }
+        atomic_fetch_or(word, bit);
+    } else if (word) {
+        atomic_fetch_and(word, ~bit);
+    }
+}
+
+/* Find the first member at or after *pos, skipping missing pages and
+   empty words whole. Returns 0 once there is none; otherwise sets *inode
+   and moves *pos past it. */
+static int iset_next(InodeSet *set, uint64_t *pos, uint32_t *inode)
+{
+    uint64_t i = *pos;
+
+    while (i < (uint64_t)INODE_WORDS * 64) {
+        InodeWord *page = atomic_load(&set->pages[i >> INODE_PAGE_SHIFT]);
+        if (!page) {
+            i = ((i >> INODE_PAGE_SHIFT) + 1) << INODE_PAGE_SHIFT;
+            continue;
+        }
+        uint64_t bits = atomic_load(&page[(i / 64) % INODE_PAGE_WORDS]) >> (i % 64);
+        if (bits) {
+            i += (uint64_t)__builtin_ctzll(bits);
+            *inode = (uint32_t)i;
+            *pos = i + 1;
+            return 1;
+        }
+        i = (i | 63) + 1;
+    }
+    return 0;
+}
+
+/* Empty a set, freeing its pages; no other thread may be using it */
+static void iset_clear(InodeSet *set)
+{
+    for (uint32_t p = 0; p < INODE_PAGES; p++) {
+        free(atomic_load(&set->pages[p]));
+        atomic_store(&set->pages[p], NULL);
+    }
+}
+
+static void iset_free(InodeSet *set)
+{
+    if (set) {
+        iset_clear(set);
+        free(set->pages);
+        free(set);
+    }
+}
+
+/* Make dst a copy of src; no other thread may be using dst */
+static void iset_copy(InodeSet *dst, InodeSet *src)
+{
+    iset_clear(dst);
+    for (uint32_t p = 0; p < INODE_PAGES; p++) {
+        InodeWord *page = atomic_load(&src->pages[p]);
+        if (!page) {
+            continue;
+        }
+        InodeWord *copy = iset_word(dst, p << INODE_PAGE_SHIFT, 1);
+        if (!copy) {
+            die("out of memory");
+        }
+        for (uint32_t w = 0; w < INODE_PAGE_WORDS; w++) {
+            atomic_store(&copy[w], atomic_load(&page[w]));
+        }
+    }
+}
+
+static int inode_used(uint32_t inode)
+{
+    return iset_has(&inode_used_set, inode);
+}
+
+static void inode_set_used(uint32_t inode, int used)
+{
+    iset_put(&inode_used_set, inode, used);
+}
+
+/* An inode's type: 'd' or 'f' while it is in use, 0 once it is free */
+static char inode_type(uint32_t inode)
+{
+    if (!inode_used(inode)) {
+        return 0;
+    }
+    return iset_has(&inode_dir_set, inode) ? 'd' : 'f';
+}
+
+static void inode_set_type(uint32_t inode, char type)
+{
+    iset_put(&inode_dir_set, inode, type == 'd');
+}
+
+static void cwd_unpin_locked(CwdPin *pin)
+{
+    if (--pin->refs > 0) {
+        return;
+    }
+    CwdPin **pp = &cwd_pins[pin->inode % CWD_PIN_BUCKETS];
+    while (*pp != pin) {
+        pp = &(*pp)->next;
+    }
+    *pp = pin->next;
+    free(pin);
+    atomic_fetch_sub(&cwd_pin_count, 1);
+}
+
+/* Move a session into directory inode, which the caller holds live */
+static void session_set_cwd(Session *s, uint32_t inode)
+{
+    CwdPin *pin = NULL;
+
+    pthread_mutex_lock(&cwd_pin_lock);
+    if (inode != 0) {
+        pin = cwd_pins[inode % CWD_PIN_BUCKETS];
+        while (pin && (pin->inode != inode || atomic_load(&pin->removed))) {
+            pin = pin->next;
+        }
+        if (!pin) {
+            pin = calloc(1, sizeof(CwdPin));
+            if (!pin) {
+                die("cd: out of memory");
+            }
+            pin->inode = inode;
+            pin->next = cwd_pins[inode % CWD_PIN_BUCKETS];
+            cwd_pins[inode % CWD_PIN_BUCKETS] = pin;
+            atomic_fetch_add(&cwd_pin_count, 1);
+        }
+        pin->refs++;
+    }
+    if (s->pin) {
+        cwd_unpin_locked(s->pin);
+    }
+    pthread_mutex_unlock(&cwd_pin_lock);
+
+    s->cwd = inode;
+    s->pin = pin;
+}
+
+/* Mark the pins of a directory that is being removed, or of every
+   directory for MAX_INODES. Done before the number can be reused. */
+static void cwd_pins_remove(uint32_t inode)
+{
+    if (atomic_load(&cwd_pin_count) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&cwd_pin_lock);
+    for (size_t b = 0; b < CWD_PIN_BUCKETS; b++) {
+        if (inode != MAX_INODES && b != inode % CWD_PIN_BUCKETS) {
+            continue;
+        }
+        for (CwdPin *pin = cwd_pins[b]; pin; pin = pin->next) {
+            if (inode == MAX_INODES || pin->inode == inode) {
+                atomic_store(&pin->removed, 1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cwd_pin_lock);
+}
+
+/* Report a failed system call on a session's error stream */
+static void sess_perror(Session *s, const char *msg)
+{
+    fprintf(s->err, "%s: %s\n", msg, strerror(errno));
+}
+
+/* Check whether a path refers to a directory on the real file system */
+static int is_directory(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    return S_ISDIR(st.st_mode);
+}
+
+/* Copy a name into a legacy record's 32-byte field, truncating it */
+static void make_name32(char dst[DIRENT_NAME_LEN], const char *src)
+{
+    memset(dst, 0, DIRENT_NAME_LEN);
+    strncpy(dst, src, DIRENT_NAME_LEN);
+}
+
+/* Make room for more bytes at the end of a record buffer */
+static int wal_reserve(WalBuf *b, size_t more)
+{
+    size_t need = b->len + more;
+    if (need <= b->cap) {
+        return 1;
+    }
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < need) {
+        cap *= 2;
+    }
+    char *buf = realloc(b->buf, cap);
+    if (!buf) {
+        return 0;
+    }
+    b->buf = buf;
+    b->cap = cap;
+    return 1;
+}
+
+/* Add a record to a buffer: wal_group, with wal_lock held, or the
+   thread's own wal_stage */
+static int wal_put(WalBuf *b, int type, const void *head, size_t head_len,
+                   const void *body, size_t body_len)
+{
+    uint32_t len = (uint32_t)(head_len + body_len);
+    if (!wal_reserve(b, 5 + (size_t)len)) {
+        return 0;
+    }
+
+    char *p = b->buf + b->len;
+    p[0] = (char)type;
+    memcpy(p + 1, &len, sizeof(len));
+    memcpy(p + 5, head, head_len);
+    if (body_len > 0) {
+        memcpy(p + 5 + head_len, body, body_len);
+    }
+    b->len += 5 + (size_t)len;
+    return 1;
+}
+
+/* Record a metadata change for the next commit */
+static void wal_append(int type, const void *head, size_t head_len,
+                       const void *body, size_t body_len)
+{
+    if (!wal_on) {
+        return;
+    }
+
+    if (wal_staging) {
+        if (!wal_put(&wal_stage, type, head, head_len, body, body_len)) {
+            wal_stage_lost = 1;
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&wal_lock);
+    if (!wal_put(&wal_group, type, head, head_len, body, body_len)) {
+        wal_lost = 1;
+    }
+    pthread_mutex_unlock(&wal_lock);
+    mark_dirty();
+}
+
+/* Hold this thread's records back from the journal */
+static void wal_stage_begin(void)
+{
+    wal_staging = 1;
+    wal_stage.len = 0;
+    wal_stage_lost = 0;
+}
+
+/* Stop holding records back: if keep, add them to the journal in one
+   piece, else drop them, as the change did not happen */
+static void wal_stage_end(int keep)
+{
+    wal_staging = 0;
+    if (!keep || (wal_stage.len == 0 && !wal_stage_lost)) {
+        return;
+    }
+
+    pthread_mutex_lock(&wal_lock);
+    if (wal_stage_lost || !wal_reserve(&wal_group, wal_stage.len)) {
+        wal_lost = 1;
+    } else {
+        memcpy(wal_group.buf + wal_group.len, wal_stage.buf, wal_stage.len);
+        wal_group.len += wal_stage.len;
+    }
+    pthread_mutex_unlock(&wal_lock);
+    mark_dirty();
+}
+
+/* A new file inode, whose host file holds name */
+static void wal_file(uint32_t inode, const char *name)
+{
+    char rec[sizeof(uint32_t) + NAME_LEN];
+    size_t len = strnlen(name, NAME_LEN);
+    memcpy(rec, &inode, sizeof(uint32_t));
+    memcpy(rec + sizeof(uint32_t), name, len);
+    wal_append(WAL_FILE, rec, sizeof(uint32_t) + len, NULL, 0);
+}
+
+static void wal_free(uint32_t inode)
+{
+    wal_append(WAL_FREE, &inode, sizeof(inode), NULL, 0);
+}
+
+/* A file's size and extents after a write or truncate */
+static void wal_extents(const FileMap *fm)
+{
+    char head[sizeof(uint32_t) + sizeof(uint64_t)];
+    memcpy(head, &fm->inode, sizeof(uint32_t));
+    memcpy(head + sizeof(uint32_t), &fm->size, sizeof(uint64_t));
+    wal_append(WAL_EXTENTS, head, sizeof(head), fm->ext, fm->n * sizeof(Extent));
+}
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+        }
+        crc32c_table[i] = c;
+    }
+#ifdef CRC32C_SSE42
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifdef CRC32C_SSE42
+/* The SSE4.2 crc32 instruction, eight bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t c, const unsigned char *p, size_t n)
+{
+    uint64_t c64 = c;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c64 = _mm_crc32_u64(c64, v);
+    }
+    c = (uint32_t)c64;
+    for (; n > 0; p++, n--) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return c;
+}
+#endif
+
+/* CRC32C (Castagnoli) of n bytes, continuing from crc (0 to start) */
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t n)
+{
+    const unsigned char *p = buf;
+    uint32_t c = ~crc;
+
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef CRC32C_SSE42
+    if (crc32c_hw) {
+        return ~crc32c_sse42(c, p, n);
+    }
+#endif
+    for (; n > 0; p++, n--) {
+        c = crc32c_table[(c ^ *p) & 0xff] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+/* A directory's checksum as of the last save, or NULL if it has none */
+static DirSum *dir_sum_find(uint32_t inode)
+{
+    size_t lo = 0, hi = dir_nsums;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dir_sums[mid].inode < inode) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < dir_nsums && dir_sums[lo].inode == inode ? &dir_sums[lo] : NULL;
+}
+
+/* Keep the sum of an evicted directory that has none in the table, for
+   the next save. The caller holds dcache_lock. */
+static void sums_note(uint32_t inode, uint32_t sum)
+{
+    if (sums_nnoted == sums_noted_cap) {
+        size_t cap = sums_noted_cap ? sums_noted_cap * 2 : 64;
+        SumNote *v = realloc(sums_noted, cap * sizeof(SumNote));
+        if (!v) {
+            return;
+        }
+        sums_noted = v;
+        sums_noted_cap = cap;
+    }
+    sums_noted[sums_nnoted].ds.inode = inode;
+    sums_noted[sums_nnoted].ds.sum = sum;
+    sums_noted[sums_nnoted].seq = sums_nnoted;
+    sums_nnoted++;
+}
+
+/* Delete the checksums file before a write makes it out of date */
+static void sums_invalidate(void)
+{
+    if (atomic_exchange(&sums_on_disk, 0) && unlink("checksums") != 0 && errno != ENOENT) {
+        perror("checksums");
+    }
+}
+
+/* Load the checksums file, if there is one. Returns 0 if there is none
+   or it cannot be used. */
+static int sums_load(void)
+{
+    FILE *f = fopen("checksums", "rb");
+    if (!f) {
+        return 0;
+    }
+
+    char head[SUMS_HEADER];
+    uint32_t n, sum;
+    DirSum *v = NULL;
+    int ok = fread(head, sizeof(head), 1, f) == 1 && memcmp(head, SUMS_MAGIC, 8) == 0;
+    if (ok) {
+        memcpy(&n, head + 8, sizeof(uint32_t));
+        memcpy(&sum, head + 12, sizeof(uint32_t));
+        v = malloc(((size_t)n + 1) * sizeof(DirSum));
+        ok = v && fread(v, sizeof(DirSum), n, f) == n && fgetc(f) == EOF &&
+             crc32c(crc32c(0, head + 16, 4), v, (size_t)n * sizeof(DirSum)) == sum;
+    }
+    fclose(f);
+
+    for (uint32_t i = 1; ok && i < n; i++) {
+        ok = v[i - 1].inode < v[i].inode;
+    }
+    if (!ok) {
+        fprintf(stderr, "checksums: corrupt, ignored\n");
+        free(v);
+        return 0;
+    }
+
+    free(dir_sums);
+    dir_sums = v;
+    dir_nsums = n;
+    memcpy(&ilist_sum, head + 16, sizeof(uint32_t));
+    ilist_sum_known = 1;
+    atomic_store(&sums_on_disk, 1);
+    return 1;
+}
+
+/* FNV-1a, to tell a complete journal group from a torn one */
+static uint32_t fnv1a(const char *p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (uint8_t)p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Read a version 1 inode list, one record at a time */
+static void read_inodes_v1(const char *buf, size_t len, InodeSet *used, InodeSet *dirs)
+{
+    for (size_t off = 0; off + 5 <= len; off += 5) {
+        uint32_t index;
+        char type = buf[off + 4];
+        memcpy(&index, buf + off, sizeof(uint32_t));
+
+        if (index >= MAX_INODES) {
+            fprintf(stderr, "Invalid inode (out of range): %u\n", (unsigned)index);
+            continue;
+        }
+
+        if (type != 'd' && type != 'f') {
+            fprintf(stderr, "Invalid inode type for inode %u\n", (unsigned)index);
+            continue;
+        }
+
+        iset_put(used, index, 1);
+        iset_put(dirs, index, type == 'd');
+    }
+}
+
+/* Read a version 2 inode list: the bitmap words are copied as they are */
+static int read_inodes_v2(const char *buf, size_t len, InodeSet *used, InodeSet *dirs)
+{
+    uint32_t version, nchunks, sum;
+    uint64_t count, seen = 0;
+    memcpy(&version, buf + 8, sizeof(uint32_t));
+    memcpy(&nchunks, buf + 12, sizeof(uint32_t));
+    memcpy(&count, buf + 16, sizeof(uint64_t));
+    memcpy(&sum, buf + 24, sizeof(uint32_t));
+
+    if (version != 2 || sum != crc32c(0, buf + ILIST_HEADER, len - ILIST_HEADER)) {
+        return 0;
+    }
+
+    size_t off = ILIST_HEADER;
+    for (uint32_t c = 0; c < nchunks; c++) {
+        uint32_t first, n;
+        if (len - off < 2 * sizeof(uint32_t)) {
+            return 0;
+        }
+        memcpy(&first, buf + off, sizeof(uint32_t));
+        memcpy(&n, buf + off + 4, sizeof(uint32_t));
+        off += 2 * sizeof(uint32_t);
+
+        /* A chunk stays within one page */
+        if (first >= INODE_WORDS || n == 0 || n > INODE_PAGE_WORDS ||
+            first % INODE_PAGE_WORDS + n > INODE_PAGE_WORDS ||
+            (len - off) / (2 * sizeof(uint64_t)) < n) {
+            return 0;
+        }
+
+        InodeWord *uw = iset_word(used, first * 64, 1);
+        InodeWord *dw = iset_word(dirs, first * 64, 1);
+        if (!uw || !dw) {
+            die("inodes_list: out of memory");
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t u, d;
+            memcpy(&u, buf + off + i * sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&d, buf + off + (n + i) * sizeof(uint64_t), sizeof(uint64_t));
+            atomic_store(&uw[i], u);
+            atomic_store(&dw[i], d & u);
+            seen += (uint64_t)__builtin_popcountll(u);
+        }
+        off += 2 * (size_t)n * sizeof(uint64_t);
+    }
+
+    /* The tombstone is never an inode */
+    if (iset_has(used, DIRENT_TOMBSTONE)) {
+        return 0;
+    }
+    return off == len && seen == count;
+}
+
+/* Read a binary inode list of either version into two empty sets. The
+   file is read with one call; if sum is set, it gets the file's CRC32C.
+   Returns its version, or 0 after printing why it cannot be used. */
+static int read_inodes_list(const char *path, InodeSet *used, InodeSet *dirs, uint32_t *sum)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    size_t len = (size_t)st.st_size;
+    char *buf = malloc(len ? len : 1);
+    if (!buf) {
+        die("inodes_list: out of memory");
+    }
+    ssize_t got = pread(fd, buf, len, 0);
+    close(fd);
+    if (got < 0 || (size_t)got != len) {
+        perror(path);
+        free(buf);
+        return 0;
+    }
+
+    if (sum) {
+        *sum = crc32c(0, buf, len);
+    }
+
+    int version = 1;
+    if (len >= ILIST_HEADER && memcmp(buf, ILIST_MAGIC, 8) == 0) {
+        version = 2;
+        if (!read_inodes_v2(buf, len, used, dirs)) {
+            fprintf(stderr, "%s: corrupt\n", path);
+            version = 0;
+        }
+    } else {
+        read_inodes_v1(buf, len, used, dirs);
+    }
+    free(buf);
+    return version;
+}
+
+/* Load inode usage information from the binary inodes_list file */
+static void load_inodes_list(void)
+{
+    uint32_t sum;
+    int version = read_inodes_list("inodes_list", &inode_used_set, &inode_dir_set, &sum);
+    if (!version) {
+        exit(1);
+    }
+    if (ilist_sum_known && sum != ilist_sum) {
+        die("inodes_list: checksum mismatch");
+    }
+    if (!ilist_version) {
+        ilist_version = version;
+    }
+}
+
+/* Write inodes_list.tmp in version 2: one chunk per page, from its first
+   to its last word with an inode in use */
+static int save_inodes_v2(FILE *f, uint32_t *file_sum)
+{
+    char *body = NULL;
+    size_t len = 0, cap = 0;
+    uint32_t nchunks = 0;
+    uint64_t count = 0;
+
+    for (uint32_t p = 0; p < INODE_PAGES; p++) {
+        InodeWord *uw = atomic_load(&inode_used_set.pages[p]);
+        InodeWord *dw = atomic_load(&inode_dir_set.pages[p]);
+        uint32_t lo = 0, hi = INODE_PAGE_WORDS;
+        while (uw && lo < hi && atomic_load(&uw[lo]) == 0) {
+            lo++;
+        }
+        while (uw && hi > lo && atomic_load(&uw[hi - 1]) == 0) {
+            hi--;
+        }
+        if (!uw || lo == hi) {
+            continue;
+        }
+
+        uint32_t head[2] = { p * INODE_PAGE_WORDS + lo, hi - lo };
+        size_t need = sizeof(head) + 2 * (size_t)head[1] * sizeof(uint64_t);
+        if (cap - len < need) {
+            cap = (len + need) * 2;
+            char *nb = realloc(body, cap);
+            if (!nb) {
+                free(body);
+                return 0;
+            }
+            body = nb;
+        }
+
+        memcpy(body + len, head, sizeof(head));
+        len += sizeof(head);
+        for (uint32_t w = lo; w < hi; w++) {
+            uint64_t u = atomic_load(&uw[w]);
+            uint64_t d = dw ? atomic_load(&dw[w]) & u : 0;
+            memcpy(body + len + (w - lo) * sizeof(uint64_t), &u, sizeof(uint64_t));
+            memcpy(body + len + (hi - lo + w - lo) * sizeof(uint64_t), &d, sizeof(uint64_t));
+            count += (uint64_t)__builtin_popcountll(u);
+        }
+        len += 2 * (size_t)head[1] * sizeof(uint64_t);
+        nchunks++;
+    }
+
+    char header[ILIST_HEADER] = ILIST_MAGIC;
+    uint32_t version = 2, sum = crc32c(0, body, len);
+    memcpy(header + 8, &version, sizeof(uint32_t));
+    memcpy(header + 12, &nchunks, sizeof(uint32_t));
+    memcpy(header + 16, &count, sizeof(uint64_t));
+    memcpy(header + 24, &sum, sizeof(uint32_t));
+
+    int ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+             (len == 0 || fwrite(body, len, 1, f) == 1);
+    *file_sum = crc32c(crc32c(0, header, sizeof(header)), body, len);
+    free(body);
+    return ok;
+}
+
+/* Write the current inode table to inodes_list.tmp, and its CRC32C to
+   sum */
+static int save_inodes_list(uint32_t *sum)
+{
+    FILE *f = fopen("inodes_list.tmp", "wb");
+    if (!f) {
+        perror("inodes_list");
+        return 0;
+    }
+
+    *sum = 0;
+    if (ilist_version == 2) {
+        if (!save_inodes_v2(f, sum)) {
+            perror("inodes_list");
+            fclose(f);
+            return 0;
+        }
+    } else {
+        uint64_t pos = 0;
+        uint32_t i;
+        while (iset_next(&inode_used_set, &pos, &i)) {
+            char rec[5];
+            rec[4] = inode_type(i);
+            if (rec[4]) {
+                memcpy(rec, &i, sizeof(uint32_t));
+                fwrite(rec, sizeof(rec), 1, f);
+                *sum = crc32c(*sum, rec, sizeof(rec));
+            }
+        }
+    }
+
+    if (!durable_close(f)) {
+        perror("inodes_list");
+        return 0;
+    }
+    return 1;
+}
+
+/* Look up the file map of an inode, if it has one */
+static FileMap *filemap_find(uint32_t inode)
+{
+    pthread_mutex_lock(&data_lock);
+
+    FileMap *fm = NULL;
+    if (filemap_buckets > 0) {
+        fm = filemaps[inode & (filemap_buckets - 1)];
+        while (fm && fm->inode != inode) {
+            fm = fm->next;
+        }
+    }
+
+    pthread_mutex_unlock(&data_lock);
+    return fm;
+}
+
+/* Give an inode an empty file map */
+static FileMap *filemap_create(uint32_t inode)
+{
+    FileMap *fm = calloc(1, sizeof(FileMap));
+    if (!fm) {
+        return NULL;
+    }
+    fm->inode = inode;
+    pthread_rwlock_init(&fm->lock, NULL);
+
+    pthread_mutex_lock(&data_lock);
+
+    if (filemap_count >= filemap_buckets) {
+        size_t nb = filemap_buckets ? filemap_buckets * 2 : 256;
+        FileMap **tab = calloc(nb, sizeof(FileMap *));
+        if (!tab) {
+            pthread_mutex_unlock(&data_lock);
+            pthread_rwlock_destroy(&fm->lock);
+            free(fm);
+            return NULL;
+        }
+        for (size_t i = 0; i < filemap_buckets; i++) {
+            FileMap *fm = filemaps[i];
+            while (fm) {
+                FileMap *next = fm->next;
+                fm->next = tab[fm->inode & (nb - 1)];
+                tab[fm->inode & (nb - 1)] = fm;
+                fm = next;
+            }
+        }
+        free(filemaps);
+        filemaps = tab;
+        filemap_buckets = nb;
+    }
+
+    fm->next = filemaps[inode & (filemap_buckets - 1)];
+    filemaps[inode & (filemap_buckets - 1)] = fm;
+    filemap_count++;
+
+    pthread_mutex_unlock(&data_lock);
+    mark_dirty();
+    return fm;
+}
+
+static int block_used(uint32_t b)
+{
+    return b < data_blocks && (block_bitmap[b / 8] >> (b % 8)) & 1;
+}
+
+static int block_pinned(uint32_t b)
+{
+    return b < snap_nblocks && (snap_blocks[b / 8] >> (b % 8)) & 1;
+}
+
+/* Mark a run of blocks used or free, growing the region as needed */
+static int blocks_mark(uint32_t start, uint32_t count, int used)
+{
+    uint64_t end = (uint64_t)start + count;
+    if (end > UINT32_MAX) {
+        return 0;
+    }
+
+    if (end > data_blocks) {
+        size_t old_bytes = ((size_t)data_blocks + 7) / 8;
+        size_t new_bytes = ((size_t)end + 7) / 8;
+        if (new_bytes > old_bytes) {
+            uint8_t *bm = realloc(block_bitmap, new_bytes);
+            if (!bm) {
+                return 0;
+            }
+            memset(bm + old_bytes, 0, new_bytes - old_bytes);
+            block_bitmap = bm;
+        }
+        data_blocks = (uint32_t)end;
+    }
+
+    for (uint32_t b = start; b < end; b++) {
+        if (used) {
+            block_bitmap[b / 8] |= (uint8_t)(1u << (b % 8));
+        } else if (!block_pinned(b)) {
+            block_bitmap[b / 8] &= (uint8_t)~(1u << (b % 8));
+        }
+    }
+
+    if (!used && start < block_rover) {
+        block_rover = start;
+    }
+    return 1;
+}
+
+/* Pin a run of blocks for a snapshot, marking them used as well */
+static int blocks_pin(uint32_t start, uint32_t count)
+{
+    uint64_t end = (uint64_t)start + count;
+    if (end > UINT32_MAX || !blocks_mark(start, count, 1)) {
+        return 0;
+    }
+
+    if (end > snap_nblocks) {
+        size_t old_bytes = ((size_t)snap_nblocks + 7) / 8;
+        size_t new_bytes = ((size_t)end + 7) / 8;
+        if (new_bytes > old_bytes) {
+            uint8_t *bm = realloc(snap_blocks, new_bytes);
+            if (!bm) {
+                return 0;
+            }
+            memset(bm + old_bytes, 0, new_bytes - old_bytes);
+            snap_blocks = bm;
+        }
+        snap_nblocks = (uint32_t)end;
+    }
+
+    for (uint32_t b = start; b < end; b++) {
+        snap_blocks[b / 8] |= (uint8_t)(1u << (b % 8));
+    }
+    return 1;
+}
+
+/* Mark every pinned block used again after the bitmap was cleared */
+static void blocks_add_pins(void)
+{
+    for (uint32_t b = 0; b < snap_nblocks; b++) {
+        if (block_pinned(b) && !blocks_mark(b, 1, 1)) {
+            die("snapshot: out of memory");
+        }
+    }
+}
+
+/* Allocate want contiguous blocks, preferring to continue at hint so a
+   file that keeps growing stays in one extent. Returns the first block. */
+static int alloc_blocks(uint32_t hint, uint32_t want, uint32_t *start)
+{
+    uint32_t run = 0;
+    while (run < want && !block_used(hint + run)) {
+        run++;
+    }
+
+    if (run < want) {
+        /* First fit from the rover; a free run touching the end of the
+           region can always be extended */
+        uint32_t b = block_rover;
+        hint = data_blocks;
+        while (b < data_blocks) {
+            if (block_used(b)) {
+                b++;
+                continue;
+            }
+            uint32_t s = b;
+            while (b < data_blocks && !block_used(b) && b - s < want) {
+                b++;
+            }
+            if (b - s == want || b == data_blocks) {
+                hint = s;
+                break;
+            }
+        }
+    }
+
+    if (!blocks_mark(hint, want, 1)) {
+        return 0;
+    }
+
+    while (block_rover < data_blocks && block_used(block_rover)) {
+        block_rover++;
+    }
+    *start = hint;
+    return 1;
+}
+
+/* Add a block run to the end of a file map, merging with the last extent
+   when the two are adjacent */
+static int filemap_push(FileMap *fm, uint32_t start, uint32_t count)
+{
+    if (fm->n > 0 && fm->ext[fm->n - 1].start + fm->ext[fm->n - 1].count == start) {
+        fm->ext[fm->n - 1].count += count;
+        return 1;
+    }
+
+    if (fm->n == fm->cap) {
+        uint32_t cap = fm->cap ? fm->cap * 2 : 4;
+        Extent *ext = realloc(fm->ext, cap * sizeof(Extent));
+        if (!ext) {
+            return 0;
+        }
+        fm->ext = ext;
+        fm->cap = cap;
+    }
+    fm->ext[fm->n].start = start;
+    fm->ext[fm->n].count = count;
+    fm->n++;
+    return 1;
+}
+
+/* Hold freed blocks back until the next commit. If the list cannot grow
+   they stay allocated until the next start. The caller holds data_lock. */
+static void wal_defer_free(const Extent *e)
+{
+    if (wal_nfreed == wal_freed_cap) {
+        size_t cap = wal_freed_cap ? wal_freed_cap * 2 : 64;
+        Extent *v = realloc(wal_freed, cap * sizeof(Extent));
+        if (!v) {
+            return;
+        }
+        wal_freed = v;
+        wal_freed_cap = cap;
+    }
+    wal_freed[wal_nfreed++] = *e;
+}
+
+/* Make the blocks freed before a commit available again */
+static void wal_release_blocks(void)
+{
+    pthread_mutex_lock(&data_lock);
+    for (size_t i = 0; i < wal_nfreed; i++) {
+        blocks_mark(wal_freed[i].start, wal_freed[i].count, 0);
+    }
+    wal_nfreed = 0;
+    pthread_mutex_unlock(&data_lock);
+}
+
+/* Release every block of a file, leaving it empty */
+static void filemap_truncate(FileMap *fm)
+{
+    pthread_mutex_lock(&data_lock);
+    for (uint32_t i = 0; i < fm->n; i++) {
+        if (wal_on) {
+            wal_defer_free(&fm->ext[i]);
+        } else {
+            blocks_mark(fm->ext[i].start, fm->ext[i].count, 0);
+        }
+    }
+    pthread_mutex_unlock(&data_lock);
+
+    fm->n = 0;
+    fm->size = 0;
+    wal_extents(fm);
+    mark_dirty();
+}
+
+/* Free an inode's file map and its blocks, if it has one. The caller
+   holds the parent directory exclusively, so nobody else can reach it. */
+static void filemap_drop(uint32_t inode)
+{
+    pthread_mutex_lock(&data_lock);
+
+    FileMap *fm = NULL;
+    if (filemap_buckets > 0) {
+        FileMap **pp = &filemaps[inode & (filemap_buckets - 1)];
+        while (*pp && (*pp)->inode != inode) {
+            pp = &(*pp)->next;
+        }
+        fm = *pp;
+        if (fm) {
+            *pp = fm->next;
+            filemap_count--;
+        }
+    }
+
+    pthread_mutex_unlock(&data_lock);
+
+    if (!fm) {
+        return;
+    }
+
+    filemap_truncate(fm);
+    pthread_rwlock_destroy(&fm->lock);
+    free(fm->ext);
+    free(fm);
+}
+
+static void data_open_once(void)
+{
+    data_fd = open("data", O_RDWR | O_CREAT, 0644);
+
+    /* The journal may point into the data file before the next barrier,
+       so its name has to be on disk already */
+    if (data_fd >= 0 && durability != DUR_NONE && fsync(root_fd) != 0) {
+        perror("data");
+    }
+}
+
+static int data_open(void)
+{
+    pthread_once(&data_once, data_open_once);
+    return data_fd >= 0;
+}
+
+/* Write len bytes at offset off (at most the current size) of a file,
+   allocating blocks for any growth. Each extent the range touches costs
+   one pwrite. The caller holds fm->lock exclusively. */
+static int filemap_write(FileMap *fm, uint64_t off, const char *buf, size_t len)
+{
+    if (off > fm->size || !data_open()) {
+        return 0;
+    }
+
+    uint64_t end = off + len;
+    uint64_t have = 0;
+    for (uint32_t i = 0; i < fm->n; i++) {
+        have += fm->ext[i].count;
+    }
+
+    uint64_t need = (end + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    if (need > have) {
+        uint64_t more = need - have;
+        if (more > UINT32_MAX) {
+            return 0;
+        }
+        pthread_mutex_lock(&data_lock);
+        uint32_t hint = fm->n ? fm->ext[fm->n - 1].start + fm->ext[fm->n - 1].count : block_rover;
+        uint32_t start;
+        int ok = alloc_blocks(hint, (uint32_t)more, &start);
+        if (ok && !filemap_push(fm, start, (uint32_t)more)) {
+            blocks_mark(start, (uint32_t)more, 0);
+            ok = 0;
+        }
+        pthread_mutex_unlock(&data_lock);
+        if (!ok) {
+            return 0;
+        }
+    }
+
+    uint64_t lpos = 0;
+    for (uint32_t i = 0; i < fm->n && off < end; i++) {
+        uint64_t ext_bytes = (uint64_t)fm->ext[i].count * DATA_BLOCK_SIZE;
+        if (off < lpos + ext_bytes) {
+            uint64_t in_ext = off - lpos;
+            size_t n = (size_t)(ext_bytes - in_ext < end - off ? ext_bytes - in_ext : end - off);
+            off_t phys = (off_t)((uint64_t)fm->ext[i].start * DATA_BLOCK_SIZE + in_ext);
+
+            size_t done = 0;
+            while (done < n) {
+                ssize_t w = pwrite(data_fd, buf + done, n - done, phys + (off_t)done);
+                if (w <= 0) {
+                    return 0;
+                }
+                done += (size_t)w;
+            }
+            atomic_store(&data_unsynced, 1);
+            buf += n;
+            off += n;
+        }
+        lpos += ext_bytes;
+    }
+
+    if (end > fm->size) {
+        fm->size = end;
+    }
+    wal_extents(fm);
+    mark_dirty();
+    return 1;
+}
+
+/* Copy len bytes starting at off of in_fd to a session's output. Regular
+   files, sockets and pipes are fed straight from the page cache with
+   sendfile/splice; anything else (or a kernel that refuses, or a socket
+   the session stops waiting for) goes through a large buffer. */
+static int stream_out(int in_fd, off_t off, uint64_t len, Session *s)
+{
+    FILE *out = s->out;
+    int out_fd;
+    if (s->drain) {
+        out_fd = s->drain(s);
+    } else {
+        fflush(out);
+        out_fd = fileno(out);
+    }
+
+    struct stat st;
+    int zero_copy = out_fd >= 0 && fstat(out_fd, &st) == 0 &&
+                    (S_ISREG(st.st_mode) || S_ISSOCK(st.st_mode) ||
+                     S_ISFIFO(st.st_mode));
+    int use_splice = zero_copy && S_ISFIFO(st.st_mode);
+
+    while (zero_copy && len > 0) {
+        size_t want = len < IO_CHUNK ? (size_t)len : IO_CHUNK;
+        ssize_t n;
+
+        if (use_splice) {
+            loff_t loff = off;
+            n = splice(in_fd, &loff, out_fd, NULL, want, SPLICE_F_MORE);
+        } else {
+            off_t soff = off;
+            n = sendfile(out_fd, in_fd, &soff, want);
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            s->wait_out && s->wait_out(s)) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS ||
+                      errno == EAGAIN || errno == EWOULDBLOCK)) {
+            zero_copy = 0;
+            break;
+        }
+        if (n <= 0) {
+            return n == 0;
+        }
+
+        off += n;
+        len -= (uint64_t)n;
+        stats.cat_bytes += (uint64_t)n;
+        stats.cat_zero_copy_bytes += (uint64_t)n;
+    }
+
+    if (len == 0) {
+        return 1;
+    }
+
+    char *buf = malloc(IO_CHUNK);
+    if (!buf) {
+        return 0;
+    }
+
+    int ok = 1;
+    while (len > 0) {
+        size_t want = len < IO_CHUNK ? (size_t)len : IO_CHUNK;
+        ssize_t r = pread(in_fd, buf, want, off);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            ok = r == 0;
+            break;
+        }
+        if (fwrite(buf, 1, (size_t)r, out) != (size_t)r) {
+            ok = 0;
+            break;
+        }
+        off += r;
+        len -= (uint64_t)r;
+        stats.cat_bytes += (uint64_t)r;
+    }
+
+    free(buf);
+    fflush(out);
+    return ok;
+}
+
+/* Copy a file's contents to a session's output, one stream per extent */
+static int filemap_cat(const FileMap *fm, Session *s)
+{
+    if (fm->size == 0) {
+        return 1;
+    }
+    if (!data_open()) {
+        return 0;
+    }
+
+    uint64_t left = fm->size;
+    for (uint32_t i = 0; i < fm->n && left > 0; i++) {
+        uint64_t len = (uint64_t)fm->ext[i].count * DATA_BLOCK_SIZE;
+        if (len > left) {
+            len = left;
+        }
+        if (!stream_out(data_fd, (off_t)((uint64_t)fm->ext[i].start * DATA_BLOCK_SIZE), len, s)) {
+            return 0;
+        }
+        left -= len;
+    }
+    return 1;
+}
+
+/* Read a binary extents file, calling fn with each file map it holds
+   and then with each of the map's extents (map NULL once the map was
+   found invalid). A missing file holds no maps. */
+static void read_extents(const char *path, FileMap *(*map_fn)(uint32_t inode, uint64_t size),
+                         void (*ext_fn)(FileMap *fm, Extent e))
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return;
+    }
+
+    uint32_t inode, n;
+    uint64_t size;
+
+    while (fread(&inode, sizeof(uint32_t), 1, f) == 1 &&
+           fread(&size,  sizeof(uint64_t), 1, f) == 1 &&
+           fread(&n,     sizeof(uint32_t), 1, f) == 1) {
+
+        FileMap *fm = map_fn(inode, size);
+
+        for (uint32_t i = 0; i < n; i++) {
+            Extent e;
+            if (fread(&e.start, sizeof(uint32_t), 1, f) != 1 ||
+                fread(&e.count, sizeof(uint32_t), 1, f) != 1) {
+                fclose(f);
+                return;
+            }
+            ext_fn(fm, e);
+        }
+    }
+
+    fclose(f);
+}
+
+static FileMap *load_map(uint32_t inode, uint64_t size)
+{
+    int valid = inode < MAX_INODES && inode_used(inode) &&
+                inode_type(inode) == 'f' && !filemap_find(inode);
+    if (!valid) {
+        fprintf(stderr, "Invalid extent map for inode %u\n", (unsigned)inode);
+        return NULL;
+    }
+
+    FileMap *fm = filemap_create(inode);
+    if (fm) {
+        fm->size = size;
+    }
+    return fm;
+}
+
+static void load_extent(FileMap *fm, Extent e)
+{
+    if (fm && (!blocks_mark(e.start, e.count, 1) ||
+               !filemap_push(fm, e.start, e.count))) {
+        die("extents: out of memory");
+    }
+}
+
+/* Load the file maps from the binary extents file, if there is one */
+static void load_extents(void)
+{
+    read_extents("extents", load_map, load_extent);
+}
+
+/* Write all file maps to extents.tmp */
+static int save_extents(void)
+{
+    FILE *f = fopen("extents.tmp", "wb");
+    if (!f) {
+        perror("extents");
+        return 0;
+    }
+
+    pthread_mutex_lock(&data_lock);
+    for (size_t b = 0; b < filemap_buckets; b++) {
+        for (FileMap *fm = filemaps[b]; fm; fm = fm->next) {
+            fwrite(&fm->inode, sizeof(uint32_t), 1, f);
+            fwrite(&fm->size, sizeof(uint64_t), 1, f);
+            fwrite(&fm->n, sizeof(uint32_t), 1, f);
+            for (uint32_t i = 0; i < fm->n; i++) {
+                fwrite(&fm->ext[i].start, sizeof(uint32_t), 1, f);
+                fwrite(&fm->ext[i].count, sizeof(uint32_t), 1, f);
+            }
+        }
+    }
+    pthread_mutex_unlock(&data_lock);
+
+    if (!durable_close(f)) {
+        perror("extents");
+        return 0;
+    }
+    return 1;
+}
+
+static int snap_is_pending(uint32_t inode)
+{
+    return iset_has(&snap_pending, inode);
+}
+
+/* Link an inode file into the latest snapshot before it first changes.
+   The caller then replaces or deletes the live file. */
+static void snap_preserve(uint32_t inode)
+{
+    if (!snap_is_pending(inode)) {
+        return;
+    }
+
+    char from[16], to[64];
+    snprintf(from, sizeof(from), "%u", (unsigned)inode);
+    snprintf(to, sizeof(to), "snapshots/%s/%u", snap_names[snap_count - 1], (unsigned)inode);
+    if (link(from, to) != 0 && errno != ENOENT && errno != EEXIST) {
+        perror("snapshot");
+    }
+    atomic_store(&snap_unsynced, 1);
+    iset_put(&snap_pending, inode, 0);
+}
+
+/* Thread's io_uring: the mapped submission and completion rings */
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_pending;
+} Ring;
+
+static _Thread_local Ring *io_ring;
+static _Thread_local int io_ring_tried;
+
+static int ring_enter(int fd, unsigned submit, unsigned wait)
+{
+    for (;;) {
+        long r = syscall(__NR_io_uring_enter, fd, submit, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (r >= 0 || errno != EINTR) {
+            return (int)r;
+        }
+    }
+}
+
+/* Take the next free submission entry, cleared */
+static struct io_uring_sqe *ring_sqe(Ring *r)
+{
+    unsigned tail = *r->sq_tail + r->sq_pending++;
+    unsigned idx = tail & *r->sq_mask;
+
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* Submit the queued entries and collect one completion for each. done is
+   called with every completion's user_data and result. */
+static int ring_run(Ring *r, void (*done)(void *, uint64_t, int), void *arg)
+{
+    unsigned n = r->sq_pending;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->sq_pending = 0;
+
+    unsigned submitted = 0, reaped = 0;
+    while (reaped < n) {
+        int ret = ring_enter(r->fd, n - submitted, n - reaped);
+        if (ret < 0) {
+            return 0;
+        }
+        submitted += (unsigned)ret;
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            done(arg, cqe->user_data, cqe->res);
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+static void ring_free(Ring *r, void *sq, size_t sq_sz, void *cq, size_t cq_sz)
+{
+    if (r->sqes && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, RING_SQES * sizeof(struct io_uring_sqe));
+    }
+    if (cq && cq != MAP_FAILED && cq != sq) {
+        munmap(cq, cq_sz);
+    }
+    if (sq && sq != MAP_FAILED) {
+        munmap(sq, sq_sz);
+    }
+    close(r->fd);
+    free(r);
+}
+
+static void ring_check_done(void *arg, uint64_t user_data, int res)
+{
+    (void)user_data;
+    if (res < 0) {
+        *(int *)arg = 0;
+    }
+}
+
+/* Check that the kernel has every opcode used here, including opening
+   and closing registered ("direct") descriptors */
+static int ring_usable(Ring *r)
+{
+    static const int needed[] = {
+        IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ,
+        IORING_OP_WRITE, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT
+    };
+
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, sz);
+    if (!probe) {
+        return 0;
+    }
+
+    int ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] < probe->ops_len &&
+             (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!ok) {
+        return 0;
+    }
+
+    int fds[RING_FILES];
+    for (int i = 0; i < RING_FILES; i++) {
+        fds[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, RING_FILES) != 0) {
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)".";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+
+    return ring_run(r, ring_check_done, &ok) && ok;
+}
+
+/* This thread's ring, set up on first use. NULL means io_uring was not
+   asked for (--uring) or is unusable here, and callers use blocking
+   system calls. */
+static Ring *ring_get(void)
+{
+    if (io_ring || io_ring_tried || !use_uring) {
+        return io_ring;
+    }
+    io_ring_tried = 1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = (int)syscall(__NR_io_uring_setup, RING_SQES, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    Ring *r = calloc(1, sizeof(Ring));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        sq_sz = cq_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    }
+
+    void *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    void *cq = single ? sq : mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ring_free(r, sq, sq_sz, cq, cq_sz);
+        return NULL;
+    }
+
+    r->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+
+    if (!ring_usable(r)) {
+        ring_free(r, sq, sq_sz, cq, cq_sz);
+        return NULL;
+    }
+
+    io_ring = r;
+    return r;
+}
+
+/* Add an operation to the batch, copying its data */
+static int iob_add(IoBatch *b, int kind, uint32_t inode, int fd, int flags, off_t off,
+                   const void *buf, size_t len)
+{
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 8;
+        IoOp *ops = realloc(b->ops, cap * sizeof(IoOp));
+        if (!ops) {
+            return 0;
+        }
+        b->ops = ops;
+        b->cap = cap;
+    }
+
+    IoOp *op = &b->ops[b->n];
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    op->inode = inode;
+    op->fd = fd;
+    op->flags = flags;
+    op->off = off;
+    op->len = len;
+
+    if (len > 0) {
+        op->buf = malloc(len);
+        if (!op->buf) {
+            return 0;
+        }
+        memcpy(op->buf, buf, len);
+    }
+
+    snprintf(op->path, sizeof(op->path), "%u", (unsigned)inode);
+    snprintf(op->tmp, sizeof(op->tmp), "%u.tmp", (unsigned)inode);
+    b->n++;
+    return 1;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t w = pwrite(fd, buf, len, off);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += w;
+        len -= (size_t)w;
+        off += w;
+    }
+    return 0;
+}
+
+/* Run one operation with ordinary blocking system calls */
+static int iob_run_blocking(IoOp *op)
+{
+    if (op->kind == IO_UNLINK) {
+        return unlink(op->path) == 0 || errno == ENOENT ? 0 : -errno;
+    }
+    if (op->fd >= 0) {
+        int res = pwrite_full(op->fd, op->buf, op->len, op->off);
+        return res == 0 && !durable_sync(op->fd) ? -errno : res;
+    }
+
+    const char *path = op->kind == IO_REPLACE ? op->tmp : op->path;
+    int fd = open(path, op->flags, 0666);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int res = pwrite_full(fd, op->buf, op->len, op->off);
+    if (res == 0 && !durable_sync(fd)) {
+        res = -errno;
+    }
+    if (close(fd) != 0 && res == 0) {
+        res = -errno;
+    }
+    if (res == 0 && op->kind == IO_REPLACE && rename(op->tmp, op->path) != 0) {
+        res = -errno;
+    }
+    if (res != 0 && op->kind == IO_REPLACE) {
+        unlink(op->tmp);
+    }
+    return res;
+}
+
+/* Queue the entries for ops[i] on the ring, using direct descriptor slot */
+static void iob_queue_op(Ring *r, IoOp *op, size_t i, int slot, int link_next)
+{
+    struct io_uring_sqe *sqe;
+    uint64_t tag = (uint64_t)i << 2;
+
+    if (op->kind == IO_UNLINK) {
+        sqe = ring_sqe(r);
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->user_data = tag;
+        sqe->flags = link_next ? IOSQE_IO_LINK : 0;
+        return;
+    }
+
+    if (op->fd >= 0) {
+        sqe = ring_sqe(r);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = op->fd;
+        sqe->addr = (uintptr_t)op->buf;
+        sqe->len = (unsigned)op->len;
+        sqe->off = (uint64_t)op->off;
+        sqe->user_data = tag | 1;
+        sqe->flags = durability != DUR_NONE || link_next ? IOSQE_IO_LINK : 0;
+
+        if (durability != DUR_NONE) {
+            sqe = ring_sqe(r);
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = op->fd;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->user_data = tag | 2;
+            sqe->flags = link_next ? IOSQE_IO_LINK : 0;
+        }
+        return;
+    }
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)(op->kind == IO_REPLACE ? op->tmp : op->path);
+    sqe->len = 0666;
+    sqe->open_flags = (unsigned)op->flags;
+    sqe->file_index = (unsigned)slot + 1;
+    sqe->user_data = tag;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t)op->buf;
+    sqe->len = (unsigned)op->len;
+    sqe->off = (uint64_t)op->off;
+    sqe->user_data = tag | 1;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    /* In the durable modes the data is on disk before the close, and so
+       before a replacement is renamed into place */
+    if (durability != DUR_NONE) {
+        sqe = ring_sqe(r);
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = slot;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = tag | 2;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    }
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = (unsigned)slot + 1;
+    sqe->user_data = tag | 2;
+    sqe->flags = op->kind == IO_REPLACE || link_next ? IOSQE_IO_LINK : 0;
+
+    if (op->kind == IO_REPLACE) {
+        sqe = ring_sqe(r);
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->tmp;
+        sqe->len = (unsigned)AT_FDCWD;
+        sqe->addr2 = (uintptr_t)op->path;
+        sqe->user_data = tag | 3;
+        sqe->flags = link_next ? IOSQE_IO_LINK : 0;
+    }
+}
+
+/* Record a completion against its operation. A cancelled entry only
+   counts if nothing earlier in the chain reported the real error. */
+static void iob_done(void *arg, uint64_t user_data, int res)
+{
+    IoOp *op = &((IoBatch *)arg)->ops[user_data >> 2];
+    unsigned step = user_data & 3;
+
+    if (op->kind == IO_UNLINK && res == -ENOENT) {
+        res = 0;
+    }
+    if (op->kind != IO_UNLINK && step == 1 && res >= 0 && (size_t)res < op->len) {
+        res = -EIO;
+    }
+    if (res < 0 && (op->res == 0 || op->res == -ECANCELED)) {
+        op->res = res;
+    }
+}
+
+/* Carry out every operation in the batch, RING_FILES at a time, each
+   group in one submission. Returns the number of operations that failed;
+   each keeps its error in res until iob_free. In a linked batch an
+   operation runs only if all earlier ones succeeded. */
+static size_t iob_run(IoBatch *b)
+{
+    if (b->n == 0) {
+        return 0;
+    }
+
+    Ring *r = ring_get();
+    size_t failed = 0;
+
+    for (size_t i = 0; i < b->n; ) {
+        size_t end = i + RING_FILES < b->n ? i + RING_FILES : b->n;
+
+        if (failed > 0 && b->linked) {
+            b->ops[i++].res = -ECANCELED;
+            failed++;
+            continue;
+        }
+
+        if (!r) {
+            b->ops[i].res = iob_run_blocking(&b->ops[i]);
+            failed += b->ops[i].res != 0;
+            i++;
+            continue;
+        }
+
+        for (size_t j = i; j < end; j++) {
+            iob_queue_op(r, &b->ops[j], j, (int)(j - i), b->linked && j + 1 < end);
+        }
+        if (!ring_run(r, iob_done, b)) {
+            for (size_t j = i; j < end; j++) {
+                b->ops[j].res = -errno;
+            }
+        }
+
+        for (size_t j = i; j < end; j++) {
+            if (b->ops[j].res != 0) {
+                failed++;
+                if (b->ops[j].kind == IO_REPLACE) {
+                    unlink(b->ops[j].tmp);
+                }
+            }
+        }
+        i = end;
+    }
+    return failed;
+}
+
+static void iob_free(IoBatch *b)
+{
+    for (size_t i = 0; i < b->n; i++) {
+        free(b->ops[i].buf);
+    }
+    free(b->ops);
+    b->ops = NULL;
+    b->n = b->cap = 0;
+}
+
+/* Run one inode file operation now, or add it to the thread's current
+   batch if there is one */
+static int io_submit_op(int kind, uint32_t inode, int fd, int flags, off_t off,
+                        const void *buf, size_t len)
+{
+    if (snap_is_pending(inode)) {
+        snap_preserve(inode);
+        if (kind == IO_WRITE && (flags & O_TRUNC)) {
+            kind = IO_REPLACE;
+        }
+    }
+
+    if (io_batch) {
+        return iob_add(io_batch, kind, inode, fd, flags, off, buf, len);
+    }
+
+    IoBatch b = { NULL, 0, 0, 0, 0 };
+    int ok = iob_add(&b, kind, inode, fd, flags, off, buf, len) && iob_run(&b) == 0;
+    if (!ok && b.n > 0) {
+        errno = -b.ops[0].res;
+    }
+    iob_free(&b);
+    return ok;
+}
+
+static void io_read_done(void *arg, uint64_t user_data, int res)
+{
+    ((int *)arg)[user_data] = res;
+}
+
+/* Read a whole inode file into *bufp, a malloc'd buffer of *capp bytes
+   that is grown as needed. The buffer stays the caller's on failure. */
+static int io_read_into(uint32_t inode, char **bufp, size_t *capp, size_t *out_len)
+{
+    char fname[16];
+    snprintf(fname, sizeof(fname), "%u", (unsigned)inode);
+
+    Ring *r = ring_get();
+    int fd = -1;
+    if (!r) {
+        fd = open(fname, O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+    }
+
+    size_t len = 0, cap = *capp;
+    char *buf = *bufp;
+    int res;
+
+    do {
+        if (len == cap) {
+            cap = cap ? cap * 4 : 64 * 1024;
+            char *nb = realloc(buf, cap);
+            if (!nb) {
+                res = -ENOMEM;
+                break;
+            }
+            buf = nb;
+        }
+
+        if (!r) {
+            ssize_t got = pread(fd, buf + len, cap - len, (off_t)len);
+            res = got < 0 ? -errno : (int)got;
+        } else {
+            /* Open, read and close in one submission; reopening is cheap
+               next to a round trip per call */
+            int st[3] = { 0, 0, 0 };
+            struct io_uring_sqe *sqe = ring_sqe(r);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)fname;
+            sqe->open_flags = O_RDONLY;
+            sqe->file_index = 1;
+            sqe->flags = IOSQE_IO_LINK;
+
+            sqe = ring_sqe(r);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = 0;
+            sqe->addr = (uintptr_t)(buf + len);
+            sqe->len = (unsigned)(cap - len);
+            sqe->off = len;
+            sqe->user_data = 1;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+            sqe = ring_sqe(r);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = 1;
+            sqe->user_data = 2;
+
+            if (!ring_run(r, io_read_done, st)) {
+                res = -errno;
+            } else {
+                res = st[0] < 0 ? st[0] : st[1];
+            }
+        }
+
+        if (res > 0) {
+            len += (size_t)res;
+        }
+    } while (res > 0 && len == cap);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    *bufp = buf;
+    *capp = cap;
+    if (res < 0) {
+        errno = -res;
+        return 0;
+    }
+
+    *out_len = len;
+    return 1;
+}
+
+/* Read a whole inode file into a malloc'd buffer */
+static int io_read_file(uint32_t inode, char **out, size_t *out_len)
+{
+    char *buf = NULL;
+    size_t cap = 0;
+    if (!io_read_into(inode, &buf, &cap, out_len)) {
+        int err = errno;
+        free(buf);
+        errno = err;
+        return 0;
+    }
+
+    *out = buf;
+    return 1;
+}
+
+static NameRec *name_rec(uint32_t id)
+{
+    return &name_pages[id >> NAME_PAGE_SHIFT][id & ((1u << NAME_PAGE_SHIFT) - 1)];
+}
+
+/* The text of an interned name; the caller holds a reference */
+static const char *name_str(uint32_t id)
+{
+    return name_rec(id)->name;
+}
+
+static size_t name_len(uint32_t id)
+{
+    return name_rec(id)->len;
+}
+
+/* Find a name's record, NAME_NONE if it is not interned. The caller
+   holds names_lock. */
+static uint32_t name_lookup(const char *name, size_t len, uint32_t hash)
+{
+    NameTable *t = name_table;
+    if (!t) {
+        return NAME_NONE;
+    }
+
+    uint32_t id = t->heads[hash & (t->buckets - 1)];
+    while (id != NAME_NONE) {
+        NameRec *r = name_rec(id);
+        if (r->hash == hash && r->len == len && memcmp(r->name, name, len) == 0) {
+            return id;
+        }
+        id = r->next;
+    }
+    return NAME_NONE;
+}
+
+/* The number a name probably has, found without the lock: the first
+   record in its hash chain with its hash. The chains may change under
+   the search, so this can be another name's number, or NAME_NONE for a
+   name that is interned; dir_slot checks it. */
+static uint32_t name_guess(uint32_t hash)
+{
+    NameTable *t = atomic_load_explicit(&name_table, memory_order_acquire);
+    if (!t) {
+        return NAME_NONE;
+    }
+
+    uint32_t id = atomic_load_explicit(&t->heads[hash & (t->buckets - 1)],
+                                       memory_order_acquire);
+    for (int steps = 0; id != NAME_NONE && steps < NAME_GUESS_STEPS; steps++) {
+        NameRec *r = name_rec(id);
+        if (atomic_load_explicit(&r->hash, memory_order_relaxed) == hash) {
+            return id;
+        }
+        id = atomic_load_explicit(&r->next, memory_order_acquire);
+    }
+    return NAME_NONE;
+}
+
+/* Double the hash table once it holds a name per bucket */
+static void names_grow(void)
+{
+    NameTable *old = name_table;
+    size_t nb = old ? old->buckets * 2 : 1024;
+    NameTable *t = malloc(sizeof(NameTable) + nb * sizeof(uint32_t));
+    if (!t) {
+        die("names: out of memory");
+    }
+    t->old = old;
+    t->buckets = nb;
+    for (size_t b = 0; b < nb; b++) {
+        atomic_init(&t->heads[b], NAME_NONE);
+    }
+
+    for (uint32_t id = 0; id < name_next; id++) {
+        NameRec *r = name_rec(id);
+        if (r->refs > 0) {
+            r->next = atomic_load_explicit(&t->heads[r->hash & (nb - 1)], memory_order_relaxed);
+            atomic_store_explicit(&t->heads[r->hash & (nb - 1)], id, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&name_table, t, memory_order_release);
+}
+
+/* Take a reference to the len-byte name at name, interning it if it is
+   new. The caller holds names_lock. */
+static uint32_t name_intern_locked(const char *name, size_t len)
+{
+    uint32_t hash = crc32c(0, name, len);
+    uint32_t id = name_lookup(name, len, hash);
+    if (id != NAME_NONE) {
+        name_rec(id)->refs++;
+        return id;
+    }
+
+    if (!name_table || name_count >= name_table->buckets) {
+        names_grow();
+    }
+    if (name_free != NAME_NONE) {
+        id = name_free;
+        name_free = name_rec(id)->next;
+    } else {
+        if (name_next == (uint32_t)((uint64_t)NAME_PAGES << NAME_PAGE_SHIFT)) {
+            die("names: too many names");
+        }
+        id = name_next;
+        if (!name_pages[id >> NAME_PAGE_SHIFT]) {
+            name_pages[id >> NAME_PAGE_SHIFT] = malloc(sizeof(NameRec) << NAME_PAGE_SHIFT);
+            if (!name_pages[id >> NAME_PAGE_SHIFT]) {
+                die("names: out of memory");
+            }
+        }
+        name_next++;
+    }
+
+    NameRec *r = name_rec(id);
+    r->name = r->inline_name;
+    if (len >= NAME_INLINE && !(r->name = malloc(len + 1))) {
+        die("names: out of memory");
+    }
+    r->refs = 1;
+    r->hash = hash;
+    r->len = (uint8_t)len;
+    memcpy(r->name, name, len);
+    r->name[len] = '\0';
+
+    /* Linked in last, so that a lookup finds the record whole */
+    NameTable *t = name_table;
+    r->next = t->heads[hash & (t->buckets - 1)];
+    t->heads[hash & (t->buckets - 1)] = id;
+    name_count++;
+    return id;
+}
+
+/* The same for a string, cut to NAME_LEN bytes */
+static uint32_t name_get_locked(const char *name)
+{
+    return name_intern_locked(name, strnlen(name, NAME_LEN));
+}
+
+static uint32_t name_get(const char *name)
+{
+    pthread_mutex_lock(&names_lock);
+    uint32_t id = name_get_locked(name);
+    pthread_mutex_unlock(&names_lock);
+    return id;
+}
+
+/* Drop a reference that is not the last, without the lock. Returns 0,
+   having changed nothing, if it is the last. */
+static int name_unref(uint32_t id)
+{
+    atomic_uint *refs = &name_rec(id)->refs;
+    unsigned n = atomic_load_explicit(refs, memory_order_relaxed);
+    while (n > 1) {
+        if (atomic_compare_exchange_weak_explicit(refs, &n, n - 1, memory_order_release,
+                                                  memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Drop a reference; the caller holds names_lock */
+static void name_put_locked(uint32_t id)
+{
+    NameRec *r = name_rec(id);
+    if (atomic_fetch_sub(&r->refs, 1) > 1) {
+        return;
+    }
+
+    NameTable *t = name_table;
+    _Atomic uint32_t *pp = &t->heads[r->hash & (t->buckets - 1)];
+    while (*pp != id) {
+        pp = &name_rec(*pp)->next;
+    }
+    *pp = r->next;
+    if (r->name != r->inline_name) {
+        free(r->name);
+    }
+    r->next = name_free;
+    name_free = id;
+    name_count--;
+}
+
+static void name_put(uint32_t id)
+{
+    if (name_unref(id)) {
+        return;
+    }
+    pthread_mutex_lock(&names_lock);
+    name_put_locked(id);
+    pthread_mutex_unlock(&names_lock);
+}
+
+/* Drop the references of n directory entries, taking the lock once for
+   the last ones */
+static void names_put(const DirLink *links, size_t n)
+{
+    int locked = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (name_unref(links[i].name)) {
+            continue;
+        }
+        if (!locked) {
+            pthread_mutex_lock(&names_lock);
+            locked = 1;
+        }
+        name_put_locked(links[i].name);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&names_lock);
+    }
+}
+
+/* Start the pool over with just . and .., which keep a reference of
+   their own. Nothing may hold a name, or be looking one up. */
+static void names_reset(void)
+{
+    pthread_mutex_lock(&names_lock);
+    for (uint32_t id = 0; id < name_next; id++) {
+        NameRec *r = name_rec(id);
+        if (r->refs > 0 && r->name != r->inline_name) {
+            free(r->name);
+        }
+    }
+    for (size_t p = 0; p < NAME_PAGES && name_pages[p]; p++) {
+        free(name_pages[p]);
+        name_pages[p] = NULL;
+    }
+    while (name_table) {
+        NameTable *old = name_table->old;
+        free(name_table);
+        name_table = old;
+    }
+    name_count = 0;
+    name_next = 0;
+    name_free = NAME_NONE;
+
+    name_get_locked(".");
+    name_get_locked("..");
+    pthread_mutex_unlock(&names_lock);
+}
+
+/* Size of a directory record with a name of len bytes */
+static size_t dir_rec_size(size_t len)
+{
+    return (DIR_REC_HEAD + len + DIR_ALIGN - 1) & ~(size_t)(DIR_ALIGN - 1);
+}
+
+/* Find the records of a directory file: sets *legacy to its format and
+   *n to the number of whole records, and returns the length of the file
+   they make up. A torn last record is left out. */
+static size_t dir_file_scan(const char *buf, size_t len, int *legacy, size_t *n)
+{
+    if (len < DIR_HEADER || memcmp(buf, DIR_MAGIC, DIR_HEADER) != 0) {
+        *legacy = 1;
+        *n = len / sizeof(DirEnt);
+        return *n * sizeof(DirEnt);
+    }
+
+    size_t off = DIR_HEADER, count = 0;
+    while (off + DIR_REC_HEAD <= len) {
+        size_t size = dir_rec_size((uint8_t)buf[off + sizeof(uint32_t)]);
+        if (size > len - off) {
+            break;
+        }
+        off += size;
+        count++;
+    }
+    *legacy = 0;
+    *n = count;
+    return off;
+}
+
+/* Decode the record at p into out, interning its name. Returns the
+   record's size. The caller holds names_lock. */
+static size_t dir_rec_decode(const char *p, int legacy, DirLink *out)
+{
+    memcpy(&out->inode, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+
+    if (legacy) {
+        out->name = name_intern_locked(p, strnlen(p, DIRENT_NAME_LEN));
+        return sizeof(DirEnt);
+    }
+    size_t len = (uint8_t)*p;
+    out->name = name_intern_locked(p + 1, len);
+    return dir_rec_size(len);
+}
+
+/* Intern the names of the n records dir_file_scan found in buf */
+static void dir_file_decode(const char *buf, int legacy, size_t n, DirLink *out)
+{
+    const char *p = legacy ? buf : buf + DIR_HEADER;
+
+    pthread_mutex_lock(&names_lock);
+    for (size_t i = 0; i < n; i++) {
+        p += dir_rec_decode(p, legacy, &out[i]);
+    }
+    pthread_mutex_unlock(&names_lock);
+}
+
+/* Copy a name of len bytes into a record. Names are short, so this
+   goes a word at a time, the last word overlapping the one before. */
+static void name_copy(char *dst, const char *src, size_t len)
+{
+    if (len < sizeof(uint64_t)) {
+        for (size_t k = 0; k < len; k++) {
+            dst[k] = src[k];
+        }
+        return;
+    }
+
+    uint64_t w;
+    for (size_t k = 0; k + sizeof(w) < len; k += sizeof(w)) {
+        memcpy(&w, src + k, sizeof(w));
+        memcpy(dst + k, &w, sizeof(w));
+    }
+    memcpy(&w, src + len - sizeof(w), sizeof(w));
+    memcpy(dst + len - sizeof(w), &w, sizeof(w));
+}
+
+/* Encode an entry as a record at p, returning the record's size */
+static size_t dir_rec_encode(const DirLink *link, int legacy, char *p)
+{
+    if (legacy) {
+        memcpy(p, &link->inode, sizeof(uint32_t));
+        make_name32(p + sizeof(uint32_t), name_str(link->name));
+        return sizeof(DirEnt);
+    }
+
+    const NameRec *r = name_rec(link->name);
+    size_t size = dir_rec_size(r->len);
+
+    /* The padding lies in the last word: zero it, then fill the rest */
+    memset(p + size - DIR_ALIGN, 0, DIR_ALIGN);
+    memcpy(p, &link->inode, sizeof(uint32_t));
+    p[sizeof(uint32_t)] = (char)r->len;
+    name_copy(p + DIR_REC_HEAD, r->name, r->len);
+    return size;
+}
+
+/* Size of the record of a directory's entry with the given name */
+static size_t dir_link_size(const Dir *d, uint32_t name)
+{
+    return d->legacy ? sizeof(DirEnt) : dir_rec_size(name_len(name));
+}
+
+/* Work out where records from index from on start in the file, after
+   one was added, dropped or resized, and where they end */
+static void dir_layout(Dir *d, size_t from)
+{
+    size_t off = d->legacy ? 0 : DIR_HEADER;
+    if (from > 0) {
+        off = d->ents[from - 1].off + dir_link_size(d, d->ents[from - 1].name);
+    }
+    for (size_t i = from; i < d->n; i++) {
+        d->ents[i].off = (uint32_t)off;
+        off += dir_link_size(d, d->ents[i].name);
+    }
+    d->bytes = off;
+}
+
+static size_t slab_size(int c)
+{
+    return c < SLAB_CLASSES ? ((size_t)2 << c) * sizeof(DirLink) : sizeof(Dir);
+}
+
+/* Take an object of class c, carving a new chunk if the list is empty */
+static void *slab_get(int c)
+{
+    pthread_mutex_lock(&slab_lock);
+
+    if (!slab_free[c]) {
+        SlabChunk *chunk = malloc(SLAB_CHUNK);
+        if (!chunk) {
+            pthread_mutex_unlock(&slab_lock);
+            return NULL;
+        }
+        chunk->next = slab_chunks;
+        slab_chunks = chunk;
+
+        size_t size = slab_size(c);
+        char *p = (char *)&chunk->align;
+        for (size_t left = SLAB_CHUNK - offsetof(SlabChunk, align); left >= size;
+             left -= size, p += size) {
+            SlabObj *o = (SlabObj *)p;
+            o->next = slab_free[c];
+            slab_free[c] = o;
+        }
+    }
+
+    SlabObj *o = slab_free[c];
+    slab_free[c] = o->next;
+    pthread_mutex_unlock(&slab_lock);
+    return o;
+}
+
+static void slab_put(int c, void *p)
+{
+    SlabObj *o = p;
+    pthread_mutex_lock(&slab_lock);
+    o->next = slab_free[c];
+    slab_free[c] = o;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/* Free every chunk at once; no slab object may be in use */
+static void slab_reset(void)
+{
+    pthread_mutex_lock(&slab_lock);
+    while (slab_chunks) {
+        SlabChunk *chunk = slab_chunks;
+        slab_chunks = chunk->next;
+        free(chunk);
+    }
+    memset(slab_free, 0, sizeof(slab_free));
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/* The capacity a buffer for n records gets: a slab class while that is
+   big enough, else exactly n */
+static size_t ents_cap(size_t n)
+{
+    if (n > SLAB_MAX_ENTS) {
+        return n;
+    }
+    size_t cap = 2;
+    while (cap < n) {
+        cap *= 2;
+    }
+    return cap;
+}
+
+static int ents_class(size_t cap)
+{
+    return __builtin_ctzll(cap) - 1;
+}
+
+/* Allocate a buffer of a capacity ents_cap returned */
+static DirLink *ents_alloc(size_t cap)
+{
+    if (cap > SLAB_MAX_ENTS) {
+        return malloc(cap * sizeof(DirLink));
+    }
+    return slab_get(ents_class(cap));
+}
+
+static void ents_free(DirLink *ents, size_t cap)
+{
+    if (!ents) {
+        return;
+    }
+    if (cap > SLAB_MAX_ENTS) {
+        free(ents);
+    } else {
+        slab_put(ents_class(cap), ents);
+    }
+}
+
+/* A zeroed Dir with no buffer and no descriptor */
+static Dir *dir_new(void)
+{
+    Dir *d = slab_get(SLAB_CLASSES);
+    if (d) {
+        memset(d, 0, sizeof(*d));
+        d->fd = -1;
+    }
+    return d;
+}
+
+/* Count a directory's memory against the cache budget once its buffer
+   has been allocated or resized */
+static void dir_account(Dir *d)
+{
+    size_t bytes = sizeof(Dir) + d->cap * sizeof(DirLink) + d->dirty_cap * sizeof(uint32_t);
+    atomic_fetch_add(&dcache_bytes, bytes - d->charged);
+    d->charged = bytes;
+}
+
+/* Each thread's buffer for directory files: they are read into it
+   before their names are interned, and their records are built in it
+   to be written or journaled */
+static _Thread_local char *dir_scratch;
+static _Thread_local size_t dir_scratch_cap;
+
+/* Build records from..to of a directory in its format in the scratch
+   buffer, after the file header if head is set and the format has one */
+static char *dir_encode(const Dir *d, int head, size_t from, size_t to, size_t *len)
+{
+    size_t start = from < d->n ? d->ents[from].off : d->bytes;
+    size_t need = (to < d->n ? d->ents[to].off : d->bytes) - start +
+                  (head && !d->legacy ? DIR_HEADER : 0);
+    if (need > dir_scratch_cap) {
+        char *buf = realloc(dir_scratch, need);
+        if (!buf) {
+            return NULL;
+        }
+        dir_scratch = buf;
+        dir_scratch_cap = need;
+    }
+
+    char *p = dir_scratch;
+    if (head && !d->legacy) {
+        memcpy(p, DIR_MAGIC, DIR_HEADER);
+        p += DIR_HEADER;
+    }
+    for (size_t i = from; i < to; i++) {
+        p += dir_rec_encode(&d->ents[i], d->legacy, p);
+    }
+    *len = (size_t)(p - dir_scratch);
+    return dir_scratch;
+}
+
+/* CRC32C of the file a directory's records make up, in its format */
+static uint32_t dir_sum(const Dir *d)
+{
+    char buf[4096];
+    size_t fill = 0;
+    uint32_t sum = 0;
+
+    if (!d->legacy) {
+        memcpy(buf, DIR_MAGIC, DIR_HEADER);
+        fill = DIR_HEADER;
+    }
+    for (size_t i = 0; i < d->n; i++) {
+        if (fill + sizeof(uint32_t) + DIR_ALIGN + NAME_LEN > sizeof(buf)) {
+            sum = crc32c(sum, buf, fill);
+            fill = 0;
+        }
+        fill += dir_rec_encode(&d->ents[i], d->legacy, buf + fill);
+    }
+    return crc32c(sum, buf, fill);
+}
+
+/* A directory's whole file, for new and compacted directories */
+static void wal_dir(const Dir *d)
+{
+    if (!wal_on) {
+        return;
+    }
+
+    size_t len;
+    char *buf = dir_encode(d, 1, 0, d->n, &len);
+    if (!buf) {
+        pthread_mutex_lock(&wal_lock);
+        wal_lost = 1;
+        pthread_mutex_unlock(&wal_lock);
+        mark_dirty();
+        return;
+    }
+    wal_append(WAL_DIR, &d->inode, sizeof(uint32_t), buf, len);
+}
+
+/* One directory record, appended or overwritten in place */
+static void wal_dirent(const Dir *d, size_t slot)
+{
+    if (!wal_on) {
+        return;
+    }
+
+    uint32_t head[2] = { d->inode, (uint32_t)slot };
+    char rec[DIR_REC_HEAD + NAME_LEN + DIR_ALIGN];
+    size_t size = dir_rec_encode(&d->ents[slot], 0, rec);
+    wal_append(WAL_DIRENT, head, sizeof(head), rec, size);
+}
+
+/* Read a directory file into d. Returns 0 if it cannot be read. */
+static int dir_read_file(Dir *d)
+{
+    size_t len;
+    if (!io_read_into(d->inode, &dir_scratch, &dir_scratch_cap, &len)) {
+        return 0;
+    }
+    char *buf = dir_scratch;
+
+    /* A torn last record is ignored, here and in the sum */
+    size_t n;
+    size_t valid = dir_file_scan(buf, len, &d->legacy, &n);
+    uint32_t sum = crc32c(0, buf, valid);
+
+    /* Eviction updates sums under dcache_lock */
+    pthread_mutex_lock(&dcache_lock);
+    DirSum *ds = dir_sum_find(d->inode);
+    int bad = ds && ds->sum != sum;
+    pthread_mutex_unlock(&dcache_lock);
+
+    if (bad) {
+        fprintf(stderr, "directory %u: checksum mismatch\n", (unsigned)d->inode);
+        errno = EIO;
+        return 0;
+    }
+
+    d->cap = ents_cap(n);
+    d->ents = ents_alloc(d->cap);
+    if (!d->ents) {
+        errno = ENOMEM;
+        return 0;
+    }
+    dir_file_decode(buf, d->legacy, n, d->ents);
+    d->n = n;
+    d->torn = valid < len;
+    dir_account(d);
+    for (size_t i = 0; i < d->n; i++) {
+        if (d->ents[i].inode == DIRENT_TOMBSTONE) {
+            d->dead++;
+        }
+    }
+
+    dir_layout(d, 0);
+    d->clean = d->n;
+    d->clean_bytes = d->bytes;
+    return 1;
+}
+
+static atomic_int dir_fds;
+
+/* Open a directory's file for writing and keep the descriptor, unless
+   DIR_FDS_MAX directories already hold one. extra_flags may add O_CREAT
+   and O_TRUNC for a new directory. */
+static int dir_open_fd(Dir *d, int extra_flags)
+{
+    if (d->fd >= 0) {
+        return d->fd;
+    }
+    if (atomic_fetch_add(&dir_fds, 1) >= DIR_FDS_MAX) {
+        atomic_fetch_sub(&dir_fds, 1);
+        return -1;
+    }
+
+    char fname[16];
+    snprintf(fname, sizeof(fname), "%u", (unsigned)d->inode);
+
+    d->fd = open(fname, O_WRONLY | O_CLOEXEC | extra_flags, 0666);
+    if (d->fd < 0) {
+        atomic_fetch_sub(&dir_fds, 1);
+    }
+    return d->fd;
+}
+
+static void dir_close_fd(Dir *d)
+{
+    if (d->fd >= 0) {
+        close(d->fd);
+        d->fd = -1;
+        atomic_fetch_sub(&dir_fds, 1);
+    }
+}
+
+static void dir_free(Dir *d)
+{
+    atomic_fetch_sub(&dcache_bytes, d->charged);
+    dir_close_fd(d);
+    names_put(d->ents, d->n);
+    ents_free(d->ents, d->cap);
+    free(d->dirty);
+    slab_put(SLAB_CLASSES, d);
+}
+
+/* Put a directory into the cache and return the cached copy. If one is
+   already there it is kept and d freed, unless replace is set. */
+static Dir *dcache_insert(Dir *d, int replace)
+{
+    pthread_mutex_lock(&dcache_lock);
+
+    if (dcache_count >= dcache_buckets) {
+        size_t nb = dcache_buckets ? dcache_buckets * 2 : 256;
+        Dir **tab = calloc(nb, sizeof(Dir *));
+        if (tab) {
+            for (size_t i = 0; i < dcache_buckets; i++) {
+                Dir *e = dcache[i];
+                while (e) {
+                    Dir *next = e->next;
+                    e->next = tab[e->inode & (nb - 1)];
+                    tab[e->inode & (nb - 1)] = e;
+                    e = next;
+                }
+            }
+            free(dcache);
+            dcache = tab;
+            dcache_buckets = nb;
+        }
+    }
+
+    Dir **pp = &dcache[d->inode & (dcache_buckets - 1)];
+    while (*pp && (*pp)->inode != d->inode) {
+        pp = &(*pp)->next;
+    }
+
+    Dir *old = *pp;
+    d->ref = 1;
+    if (!old) {
+        d->next = NULL;
+        *pp = d;
+        dcache_count++;
+    } else if (replace) {
+        d->next = old->next;
+        *pp = d;
+    } else {
+        old = d;
+        d = *pp;
+    }
+
+    pthread_mutex_unlock(&dcache_lock);
+
+    if (old) {
+        dir_free(old);
+    }
+    return d;
+}
+
+/* Find a cached directory. touch marks it used for the clock hand;
+   saves and flushes look without it, so that they keep nothing cached. */
+static Dir *dcache_find(uint32_t inode, int touch)
+{
+    pthread_mutex_lock(&dcache_lock);
+
+    Dir *d = NULL;
+    if (dcache_buckets > 0) {
+        d = dcache[inode & (dcache_buckets - 1)];
+        while (d && d->inode != inode) {
+            d = d->next;
+        }
+        if (d && touch) {
+            d->ref = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&dcache_lock);
+    return d;
+}
+
+static Dir *dcache_lookup(uint32_t inode)
+{
+    return dcache_find(inode, 1);
+}
+
+/* Get the in-memory copy of a directory, reading its file on first use.
+   The caller holds the directory's lock, shared or exclusive. */
+static Dir *dir_get(uint32_t inode)
+{
+    Dir *d = dcache_lookup(inode);
+    if (d) {
+        return d;
+    }
+
+    d = dir_new();
+    if (!d) {
+        return NULL;
+    }
+    d->inode = inode;
+    if (!dir_read_file(d)) {
+        dir_free(d);
+        return NULL;
+    }
+
+    /* Another reader holding the same shared lock may have loaded it too */
+    return dcache_insert(d, 0);
+}
+
+/* Drop a freed directory from the cache */
+static void dir_forget(uint32_t inode)
+{
+    pthread_mutex_lock(&dcache_lock);
+
+    Dir *d = NULL;
+    if (dcache_buckets > 0) {
+        Dir **pp = &dcache[inode & (dcache_buckets - 1)];
+        while (*pp && (*pp)->inode != inode) {
+            pp = &(*pp)->next;
+        }
+        d = *pp;
+        if (d) {
+            *pp = d->next;
+            dcache_count--;
+        }
+    }
+
+    pthread_mutex_unlock(&dcache_lock);
+
+    if (d) {
+        dir_free(d);
+    }
+}
+
+static int dir_is_dirty(const Dir *d)
+{
+    return d->rewrite || d->clean < d->n || d->ndirty > 0;
+}
+
+/* Drop a directory the clock hand found unused, unless it has been used
+   since or has changes not yet written. Returns 0 if it stays because
+   it is dirty. Its file matches it, so its checksum is brought up to
+   date for the next time it is read. */
+static int dcache_evict(uint32_t inode)
+{
+    int kept_dirty = 0;
+    lock_inode(inode, 1);
+    pthread_mutex_lock(&dcache_lock);
+
+    Dir **pp = &dcache[inode & (dcache_buckets - 1)];
+    while (*pp && (*pp)->inode != inode) {
+        pp = &(*pp)->next;
+    }
+    Dir *d = *pp;
+    if (d && !d->ref && dir_is_dirty(d)) {
+        kept_dirty = 1;
+        d = NULL;
+    } else if (d && !d->ref) {
+        *pp = d->next;
+        dcache_count--;
+        DirSum *ds = dir_sum_find(inode);
+        if (ds) {
+            ds->sum = dir_sum(d);
+        } else {
+            sums_note(inode, dir_sum(d));
+        }
+    } else {
+        d = NULL;
+    }
+
+    pthread_mutex_unlock(&dcache_lock);
+    unlock_inode(inode);
+
+    if (d) {
+        dir_free(d);
+        atomic_fetch_add(&stats.dir_evictions, 1);
+    }
+    return !kept_dirty;
+}
+
+static int slot_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Queue one write of records from..to at their place in the file */
+static int dir_write_range(Dir *d, int fd, size_t from, size_t to)
+{
+    size_t len;
+    char *buf = dir_encode(d, from == 0, from, to, &len);
+    off_t off = from == 0 ? 0 : (off_t)d->ents[from].off;
+    return buf && io_submit_op(IO_WRITE, d->inode, fd, O_WRONLY, off, buf, len);
+}
+
+/* Bring a directory file up to date with its in-memory copy. Each run
+   of records changed in place is written over its old bytes, and records
+   added since are appended with one more write; all go through the
+   directory's cached descriptor unless they run after the caller's locks
+   are dropped (the directory could be freed by then). A compacted
+   directory, or a new one without a descriptor, is written whole to a
+   temp file and renamed into place. */
+static int dir_write_out(Dir *d)
+{
+    int ok = 1;
+
+    sums_invalidate();
+
+    /* A file a snapshot shares must not be written in place */
+    if (snap_is_pending(d->inode)) {
+        snap_preserve(d->inode);
+        d->rewrite = 1;
+    }
+
+    if (d->rewrite) {
+        /* After the rename the descriptor would point at the old file */
+        dir_close_fd(d);
+        size_t len;
+        char *buf = dir_encode(d, 1, 0, d->n, &len);
+        ok = buf && io_submit_op(IO_REPLACE, d->inode, -1, O_WRONLY | O_CREAT | O_TRUNC, 0,
+                                 buf, len);
+        if (ok) {
+            d->torn = 0;
+        }
+    } else if (d->ndirty > 0 || d->clean < d->n) {
+        int fd = io_batch && io_batch->detached ? -1 : dir_open_fd(d, 0);
+
+        /* Writes of their own go out as one batch */
+        IoBatch local = { NULL, 0, 0, 0, 0 };
+        int own = !io_batch;
+        if (own) {
+            io_batch = &local;
+        }
+
+        qsort(d->dirty, d->ndirty, sizeof(uint32_t), slot_cmp);
+        for (size_t k = 0; ok && k < d->ndirty; ) {
+            size_t from = d->dirty[k], to = from + 1;
+            while (k < d->ndirty && d->dirty[k] <= to) {
+                to = (size_t)d->dirty[k++] + 1;
+            }
+            ok = dir_write_range(d, fd, from, to);
+        }
+        if (ok && d->clean < d->n) {
+            ok = dir_write_range(d, fd, d->clean, d->n);
+        }
+
+        if (own) {
+            io_batch = NULL;
+            if (ok && iob_run(&local) > 0) {
+                for (size_t i = 0; i < local.n; i++) {
+                    if (local.ops[i].res != 0) {
+                        errno = -local.ops[i].res;
+                        break;
+                    }
+                }
+                ok = 0;
+            }
+            iob_free(&local);
+        }
+    }
+
+    if (ok) {
+        d->rewrite = 0;
+        d->clean = d->n;
+        d->clean_bytes = d->bytes;
+        d->ndirty = 0;
+    }
+    return ok;
+}
+
+static int note_cmp(const void *a, const void *b)
+{
+    const SumNote *x = a, *y = b;
+    if (x->ds.inode != y->ds.inode) {
+        return x->ds.inode < y->ds.inode ? -1 : 1;
+    }
+    return x->seq > y->seq ? -1 : x->seq < y->seq;
+}
+
+/* The latest sum noted for a directory, in notes sorted by note_cmp */
+static const DirSum *note_find(uint32_t inode)
+{
+    size_t lo = 0, hi = sums_nnoted;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sums_noted[mid].ds.inode < inode) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < sums_nnoted && sums_noted[lo].ds.inode == inode ? &sums_noted[lo].ds : NULL;
+}
+
+/* Write checksums.tmp and make it the table of sums: the inode list's,
+   and for each directory the sum of its cached copy if that matches the
+   file. A directory that is not cached keeps its old sum, or the one
+   noted when it was evicted; one never read since it lost its sum has
+   none until it is. No directory file is read for this, and the cache's
+   clock is left alone. */
+static int save_sums(uint32_t list_sum)
+{
+    DirSum *v = NULL;
+    size_t n = 0, cap = 0;
+    uint64_t pos = 0;
+    uint32_t inode;
+
+    pthread_mutex_lock(&dcache_lock);
+    qsort(sums_noted, sums_nnoted, sizeof(SumNote), note_cmp);
+    pthread_mutex_unlock(&dcache_lock);
+
+    while (iset_next(&inode_dir_set, &pos, &inode)) {
+        if (!inode_used(inode)) {
+            continue;
+        }
+
+        uint32_t sum;
+        Dir *d = dcache_find(inode, 0);
+        const DirSum *old = d ? NULL : dir_sum_find(inode);
+        if (!d && !old) {
+            old = note_find(inode);
+        }
+        if (d) {
+            if (dir_is_dirty(d)) {
+                continue;
+            }
+            sum = dir_sum(d);
+        } else if (old) {
+            sum = old->sum;
+        } else {
+            continue;
+        }
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            DirSum *nv = realloc(v, cap * sizeof(DirSum));
+            if (!nv) {
+                free(v);
+                return 0;
+            }
+            v = nv;
+        }
+        v[n].inode = inode;
+        v[n].sum = sum;
+        n++;
+    }
+
+    free(dir_sums);
+    dir_sums = v;
+    dir_nsums = n;
+    sums_nnoted = 0;
+    ilist_sum = list_sum;
+    ilist_sum_known = 1;
+
+    char head[SUMS_HEADER] = SUMS_MAGIC;
+    uint32_t count = (uint32_t)n;
+    uint32_t sum = crc32c(crc32c(0, &list_sum, sizeof(uint32_t)), v, n * sizeof(DirSum));
+    memcpy(head + 8, &count, sizeof(uint32_t));
+    memcpy(head + 12, &sum, sizeof(uint32_t));
+    memcpy(head + 16, &list_sum, sizeof(uint32_t));
+
+    FILE *f = fopen("checksums.tmp", "wb");
+    if (!f) {
+        perror("checksums");
+        return 0;
+    }
+    fwrite(head, sizeof(head), 1, f);
+    if (n > 0) {
+        fwrite(v, sizeof(DirSum), n, f);
+    }
+    if (!durable_close(f)) {
+        perror("checksums");
+        return 0;
+    }
+    return 1;
+}
+
+/* Write the inode list, extent table and checksums to temp files and
+   rename them over the old ones, so a crash leaves one version or the
+   other. The old checksums go first: between the renames the list
+   would not match them. */
+static void save_lists(void)
+{
+    uint32_t list_sum;
+    int ok_list = save_inodes_list(&list_sum);
+    int ok_ext = save_extents();
+    int ok_sums = ok_list && save_sums(list_sum);
+    durable_barrier("lists-written");
+
+    sums_invalidate();
+    if (ok_list && rename("inodes_list.tmp", "inodes_list") != 0) {
+        perror("inodes_list");
+        ok_sums = 0;
+    }
+    if (ok_ext && rename("extents.tmp", "extents") != 0) {
+        perror("extents");
+    }
+    if (ok_sums) {
+        if (rename("checksums.tmp", "checksums") == 0) {
+            atomic_store(&sums_on_disk, 1);
+        } else {
+            perror("checksums");
+        }
+    }
+    durable_barrier("lists");
+}
+
+/* Queue a directory that has just become dirty for the flusher */
+static void wb_queue_dir(uint32_t inode)
+{
+    pthread_mutex_lock(&wb_lock);
+
+    if (wb_ndirs == wb_dirs_cap) {
+        size_t cap = wb_dirs_cap ? wb_dirs_cap * 2 : 64;
+        uint32_t *v = realloc(wb_dirs, cap * sizeof(uint32_t));
+        if (!v) {
+            pthread_mutex_unlock(&wb_lock);
+            return;
+        }
+        wb_dirs = v;
+        wb_dirs_cap = cap;
+    }
+    wb_dirs[wb_ndirs++] = inode;
+    atomic_store(&state_dirty, 1);
+
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* Note that a record already in the file changed in place. Once more
+   than an eighth of the file is listed, the list gives way to writing
+   everything from its lowest record on. */
+static void dir_mark(Dir *d, size_t slot)
+{
+    if (d->ndirty == d->dirty_cap) {
+        size_t cap = d->dirty_cap ? d->dirty_cap * 2 : 4;
+        uint32_t *v = cap <= d->clean / 8 + 4 ? realloc(d->dirty, cap * sizeof(uint32_t)) : NULL;
+        if (!v) {
+            for (size_t k = 0; k < d->ndirty; k++) {
+                slot = d->dirty[k] < slot ? d->dirty[k] : slot;
+            }
+            d->clean = slot;
+            d->clean_bytes = d->ents[slot].off;
+            d->ndirty = 0;
+            return;
+        }
+        d->dirty = v;
+        d->dirty_cap = cap;
+        dir_account(d);
+    }
+    d->dirty[d->ndirty++] = (uint32_t)slot;
+}
+
+/* Check that the names of records from..to fit legacy records */
+static int dir_names_fit(const Dir *d, size_t from, size_t to)
+{
+    for (size_t i = from; i < to && i < d->n; i++) {
+        if (name_len(d->ents[i].name) > DIRENT_NAME_LEN) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Record that record slot changed, or that records were appended from
+   slot on (the caller holds the directory exclusively). A directory is
+   written in the format --dir-format asks for, else in its own, except
+   that one holding a name too long for a legacy record becomes v2; a
+   change of format rewrites the file. In write-back mode the flusher
+   picks the change up later; otherwise it is written out right away. */
+static int dir_changed(Dir *d, size_t slot, int was_dirty)
+{
+    int legacy = dir_version ? dir_version == 1 : d->legacy;
+    if (legacy && legacy != d->legacy) {
+        legacy = dir_names_fit(d, 0, d->n);
+    } else if (legacy) {
+        legacy = dir_names_fit(d, slot, slot + 1) && dir_names_fit(d, d->clean, d->n);
+    }
+    if (legacy != d->legacy) {
+        d->legacy = legacy;
+        dir_layout(d, 0);
+        d->rewrite = 1;
+    }
+    if (d->torn) {
+        d->rewrite = 1;
+    }
+    if (slot < d->clean && !d->rewrite) {
+        dir_mark(d, slot);
+    }
+
+    if (!writeback) {
+        return dir_write_out(d);
+    }
+    if (!was_dirty) {
+        wb_queue_dir(d->inode);
+    }
+    return 1;
+}
+
+/* Write a file inode's host file, which holds the file's name */
+static int write_file_inode(uint32_t inode, const char *name)
+{
+    return io_submit_op(IO_WRITE, inode, -1, O_WRONLY | O_CREAT | O_TRUNC, 0,
+                        name, strnlen(name, NAME_LEN));
+}
+
+/* Set the host-file work pending for an inode, replacing whatever was
+   queued for it before: creating then deleting a file leaves only the
+   delete, deleting then reusing the number leaves only the create. */
+static void wb_set_op(uint32_t inode, int op, const char *name)
+{
+    pthread_mutex_lock(&wb_lock);
+
+    PendingOp **pp = &wb_ops[inode % PENDING_BUCKETS];
+    while (*pp && (*pp)->inode != inode) {
+        pp = &(*pp)->next;
+    }
+
+    PendingOp *p = *pp;
+    if (!p && op != OP_NONE) {
+        p = calloc(1, sizeof(PendingOp));
+        if (p) {
+            p->inode = inode;
+            p->next = wb_ops[inode % PENDING_BUCKETS];
+            wb_ops[inode % PENDING_BUCKETS] = p;
+        }
+    }
+    if (p) {
+        p->op = op;
+        if (name) {
+            free(p->name);
+            if (!(p->name = strdup(name))) {
+                die("write-back: out of memory");
+            }
+        }
+    }
+    atomic_store(&state_dirty, 1);
+
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* Run one stage of a flush. A directory whose write failed is marked
+   for a full rewrite and queued again. */
+static void wb_run_batch(IoBatch *b, int ns_exclusive)
+{
+    if (iob_run(b) > 0) {
+        for (size_t i = 0; i < b->n; i++) {
+            IoOp *op = &b->ops[i];
+            if (op->res == 0) {
+                continue;
+            }
+
+            fprintf(stderr, "write-back %s: %s\n", op->path, strerror(-op->res));
+            if (op->kind == IO_UNLINK || inode_type(op->inode) != 'd') {
+                continue;
+            }
+
+            if (!ns_exclusive) {
+                lock_inode(op->inode, 1);
+            }
+            Dir *d = dcache_find(op->inode, 0);
+            if (d) {
+                d->rewrite = 1;
+                wb_queue_dir(op->inode);
+            }
+            if (!ns_exclusive) {
+                unlock_inode(op->inode);
+            }
+        }
+    }
+    iob_free(b);
+}
+
+/* Write everything queued for write-back. Host files are created first,
+   directories written next, then (when the namespace is held exclusively)
+   the inode list and extent table, and host files are deleted last, so
+   entries never point at files that do not exist yet. In a durable mode
+   each stage is synced before the next starts. Ops are checked against the
+   current inode table, since the inode may have been freed or reused
+   since they were queued; any such change queued its own op. Only the
+   flusher calls this with the namespace lock shared, locking directories
+   while it writes them; everyone else holds it exclusively, so flushes
+   never overlap. */
+static void wb_flush(int ns_exclusive)
+{
+    pthread_mutex_lock(&wb_lock);
+    PendingOp *ops = NULL;
+    for (size_t b = 0; b < PENDING_BUCKETS; b++) {
+        while (wb_ops[b]) {
+            PendingOp *p = wb_ops[b];
+            wb_ops[b] = p->next;
+            p->next = ops;
+            ops = p;
+        }
+    }
+    uint32_t *dirs = wb_dirs;
+    size_t ndirs = wb_ndirs;
+    wb_dirs = NULL;
+    wb_ndirs = wb_dirs_cap = 0;
+    pthread_mutex_unlock(&wb_lock);
+
+    IoBatch batch = { NULL, 0, 0, 0, !ns_exclusive };
+
+    io_batch = &batch;
+    for (PendingOp *p = ops; p; p = p->next) {
+        if (p->op == OP_CREATE_FILE && inode_used(p->inode) &&
+            inode_type(p->inode) == 'f') {
+            write_file_inode(p->inode, p->name);
+        }
+    }
+    io_batch = NULL;
+    wb_run_batch(&batch, ns_exclusive);
+    durable_barrier("files");
+
+    io_batch = &batch;
+    for (size_t i = 0; i < ndirs; i++) {
+        if (!ns_exclusive) {
+            lock_inode(dirs[i], 0);
+        }
+        Dir *d = dcache_find(dirs[i], 0);
+        if (d && dir_is_dirty(d)) {
+            dir_write_out(d);
+        }
+        if (!ns_exclusive) {
+            unlock_inode(dirs[i]);
+        }
+    }
+    io_batch = NULL;
+    wb_run_batch(&batch, ns_exclusive);
+    durable_barrier("entries");
+
+    if (ns_exclusive) {
+        save_lists();
+    }
+
+    io_batch = &batch;
+    while (ops) {
+        PendingOp *p = ops;
+        ops = p->next;
+        if (p->op == OP_UNLINK && !inode_used(p->inode)) {
+            io_submit_op(IO_UNLINK, p->inode, -1, 0, 0, NULL, 0);
+        }
+        free(p->name);
+        free(p);
+    }
+    io_batch = NULL;
+    wb_run_batch(&batch, ns_exclusive);
+
+    free(dirs);
+}
+
+/* Append the records gathered since the last commit to the journal as
+   one group and make it durable; blocks freed in the meantime become
+   reusable. Returns 0 if the group could not be written, which leaves a
+   checkpoint as the only way to make the changes durable. The caller
+   holds the namespace lock exclusively, so every command's records are
+   in the group whole. */
+static int wal_commit(void)
+{
+    if (wal_lost) {
+        return 0;
+    }
+    if (wal_group.len == 0) {
+        return 1;
+    }
+
+    char rec[sizeof(uint64_t) + sizeof(uint32_t)];
+    uint32_t sum = fnv1a(wal_group.buf, wal_group.len);
+    memcpy(rec, &wal_gen, sizeof(uint64_t));
+    memcpy(rec + sizeof(uint64_t), &sum, sizeof(uint32_t));
+
+    /* File contents the group's extent records point at go first */
+    durable_sync_data();
+
+    int res = wal_put(&wal_group, WAL_COMMIT, rec, sizeof(rec), NULL, 0) ? 0 : -ENOMEM;
+    if (res == 0) {
+        res = pwrite_full(wal_fd, wal_group.buf, wal_group.len, wal_size);
+    }
+    if (res == 0 && fdatasync(wal_fd) != 0) {
+        res = -errno;
+    }
+    if (res != 0) {
+        fprintf(stderr, "journal: %s\n", strerror(-res));
+        wal_lost = 1;
+        return 0;
+    }
+
+    wal_size += (off_t)wal_group.len;
+    wal_group.len = 0;
+    crash_hook("journal");
+    wal_release_blocks();
+    return 1;
+}
+
+/* Start an empty journal of the next generation once the metadata files
+   hold everything the old one did. Should the truncate be lost, records
+   left from the old generation are not replayed. */
+static void wal_checkpoint(void)
+{
+    char hdr[WAL_HEADER];
+    wal_gen++;
+    memcpy(hdr, wal_sweep ? WAL_SWEEP_MAGIC : WAL_MAGIC, 8);
+    memcpy(hdr + 8, &wal_gen, sizeof(uint64_t));
+
+    if (pwrite_full(wal_fd, hdr, sizeof(hdr), 0) != 0 ||
+        ftruncate(wal_fd, WAL_HEADER) != 0 || fdatasync(wal_fd) != 0) {
+        perror("journal");
+    }
+
+    wal_size = WAL_HEADER;
+    wal_group.len = 0;
+    wal_lost = 0;
+    crash_hook("checkpoint");
+    wal_release_blocks();
+}
+
+/* Note in the journal's header that the files are about to take changes
+   the journal does not hold: should a crash cut the writing short, the
+   next start sweeps the tree. The next checkpoint clears it. */
+static void wal_mark_sweep(void)
+{
+    if (pwrite_full(wal_fd, WAL_SWEEP_MAGIC, 8, 0) != 0 || fdatasync(wal_fd) != 0) {
+        perror("journal");
+    }
+}
+
+/* Persist all in-memory metadata. The caller holds the namespace lock
+   exclusively (or is the only thread left). With a journal this is a
+   checkpoint: the pending records are committed first, so that whatever
+   part of the metadata files a crash leaves written is covered by the
+   journal. */
+static void save_state(void)
+{
+    atomic_store(&state_dirty, 0);
+
+    if (wal_fd >= 0 && !wal_commit()) {
+        wal_mark_sweep();
+    }
+
+    if (writeback) {
+        wb_flush(1);
+    } else {
+        save_lists();
+    }
+
+    if (wal_fd >= 0) {
+        wal_checkpoint();
+    }
+}
+
+/* Make the changes so far durable in a durable mode: append them to the
+   journal, checkpointing once it has grown large (or could not be
+   written). The caller holds the namespace lock exclusively. */
+static void commit_state(void)
+{
+    atomic_store(&state_dirty, 0);
+
+    if (!wal_commit() || wal_size >= (off_t)WAL_CHECKPOINT_BYTES) {
+        save_state();
+    }
+}
+
+/* Background flusher: waits for work, lets more pile up for
+   WRITEBACK_DELAY_MS so it can be coalesced, then writes it out (with
+   --durability interval, commits it) */
+static void *wb_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&wb_lock);
+    while (!wb_stop) {
+        int idle = wb_ndirs == 0;
+        for (size_t b = 0; idle && b < PENDING_BUCKETS; b++) {
+            idle = wb_ops[b] == NULL;
+        }
+        if (durability == DUR_INTERVAL) {
+            /* Queued writes wait for the next checkpoint */
+            idle = !atomic_load(&state_dirty);
+        }
+        if (idle) {
+            pthread_cond_wait(&wb_cond, &wb_lock);
+            continue;
+        }
+
+        /* Shutdown cuts the wait short; save_state does the final flush */
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += WRITEBACK_DELAY_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!wb_stop && pthread_cond_timedwait(&wb_cond, &wb_lock, &until) != ETIMEDOUT) {
+        }
+        if (wb_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&wb_lock);
+
+        /* A commit must not take in half of a command, so it stops
+           other commands while it runs */
+        if (durability == DUR_INTERVAL) {
+            ns_enter(1);
+            commit_state();
+        } else {
+            ns_enter(0);
+            wb_flush(0);
+        }
+        ns_leave();
+
+        pthread_mutex_lock(&wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+static void wb_start(void)
+{
+    if (pthread_create(&wb_thread, NULL, wb_main, NULL) != 0) {
+        perror("write-back thread");
+        return;
+    }
+    wb_running = 1;
+}
+
+/* Stop the flusher; whatever it left behind is written by save_state */
+static void wb_shutdown(void)
+{
+    if (!wb_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&wb_lock);
+    wb_stop = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+    pthread_join(wb_thread, NULL);
+}
+
+
+/* Find the live entry of d numbered key, if it is called name. key may
+   be a guess: an entry that has it holds a reference, so its text can be
+   checked against name. */
+static int dir_scan(const Dir *d, uint32_t key, const char *name, size_t len, size_t *slot)
+{
+    for (size_t i = 0; i < d->n; i++) {
+        if (d->ents[i].inode != DIRENT_TOMBSTONE && d->ents[i].name == key) {
+            if (name_len(key) != len || memcmp(name_str(key), name, len) != 0) {
+                return 0;
+            }
+            *slot = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Find the slot of the live entry with the given name. Its number is
+   guessed without a lock, and looked up under names_lock only if the
+   guess finds nothing; neither takes a reference, as an entry with the
+   name keeps the number in use. A name nobody has interned is in no
+   directory. */
+static int dir_slot(const Dir *d, const char *name, size_t *slot)
+{
+    size_t len = strnlen(name, NAME_LEN + 1);
+    if (len > NAME_LEN) {
+        return 0;
+    }
+    uint32_t hash = crc32c(0, name, len);
+
+    uint32_t guess = name_guess(hash);
+    if (guess != NAME_NONE && dir_scan(d, guess, name, len, slot)) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&names_lock);
+    uint32_t key = name_lookup(name, len, hash);
+    pthread_mutex_unlock(&names_lock);
+    return key != NAME_NONE && key != guess && dir_scan(d, key, name, len, slot);
+}
+
+/* Search a directory for an entry with the given name */
+static int dir_find(uint32_t dir_inode, const char *name, DirLink *out)
+{
+    Dir *d = dir_get(dir_inode);
+    size_t i;
+    if (!d || !dir_slot(d, name, &i)) {
+        return 0;
+    }
+
+    if (out) {
+        *out = d->ents[i];
+    }
+    return 1;
+}
+
+/* Make room for at least n records */
+static int dir_reserve(Dir *d, size_t n)
+{
+    if (n <= d->cap) {
+        return 1;
+    }
+
+    size_t cap = d->cap ? d->cap * 2 : 2;
+    while (cap < n) {
+        cap *= 2;
+    }
+
+    DirLink *ents;
+    if (d->cap > SLAB_MAX_ENTS) {
+        ents = realloc(d->ents, cap * sizeof(DirLink));
+    } else {
+        /* A slab buffer moves to the next class, or to the heap */
+        ents = ents_alloc(cap);
+        if (ents) {
+            memcpy(ents, d->ents, d->n * sizeof(DirLink));
+            ents_free(d->ents, d->cap);
+        }
+    }
+    if (!ents) {
+        return 0;
+    }
+    d->ents = ents;
+    d->cap = cap;
+    dir_account(d);
+    return 1;
+}
+
+/* Append a new entry to a directory */
+static int dir_append(uint32_t dir_inode, uint32_t child_inode, const char *name)
+{
+    Dir *d = dir_get(dir_inode);
+    if (!d || !dir_reserve(d, d->n + 1)) {
+        return 0;
+    }
+
+    int was_dirty = dir_is_dirty(d);
+    d->ents[d->n].inode = child_inode;
+    d->ents[d->n].name = name_get(name);
+    d->ents[d->n].off = (uint32_t)d->bytes;
+    d->bytes += dir_link_size(d, d->ents[d->n].name);
+    d->n++;
+    wal_dirent(d, d->n - 1);
+
+    return dir_changed(d, d->n - 1, was_dirty);
+}
+
+/* Take back the entries appended from index first on after their write
+   failed. The file's state is unknown, so it is rewritten on the next
+   change. */
+static void dir_unappend(Dir *d, size_t first)
+{
+    while (d->n > first) {
+        d->n--;
+        d->bytes -= dir_link_size(d, d->ents[d->n].name);
+        name_put(d->ents[d->n].name);
+    }
+    d->rewrite = 1;
+}
+
+/* Drop a directory's tombstones; the file is rewritten on the next flush */
+static void dir_compact(Dir *d)
+{
+    size_t live = 0;
+    for (size_t i = 0; i < d->n; i++) {
+        if (d->ents[i].inode != DIRENT_TOMBSTONE) {
+            d->ents[live++] = d->ents[i];
+        } else {
+            name_put(d->ents[i].name);
+        }
+    }
+    d->n = live;
+    d->dead = 0;
+    dir_layout(d, 0);
+    d->rewrite = 1;
+    wal_dir(d);
+}
+
+/* Turn the entry with the given name into a tombstone, in place; it
+   keeps its name, which the file still holds. The directory is
+   compacted afterwards if most of it is dead. */
+static int dir_remove(uint32_t dir_inode, const char *name, DirLink *out)
+{
+    Dir *d = dir_get(dir_inode);
+    size_t i;
+    if (!d || !dir_slot(d, name, &i)) {
+        return 0;
+    }
+
+    if (out) {
+        *out = d->ents[i];
+    }
+
+    int was_dirty = dir_is_dirty(d);
+    d->ents[i].inode = DIRENT_TOMBSTONE;
+    d->dead++;
+    wal_dirent(d, i);
+
+    if (d->n >= COMPACT_MIN_ENTRIES && d->dead * 2 > d->n) {
+        dir_compact(d);
+    }
+    return dir_changed(d, i, was_dirty);
+}
+
+/* Overwrite the entry with the given name in place, giving it a new
+   inode number and/or a new name (NULL keeps the old name). A name of
+   another record size shifts the records after it, so the file is
+   rewritten. */
+static int dir_update(uint32_t dir_inode, const char *name,
+                      uint32_t new_inode, const char *new_name)
+{
+    Dir *d = dir_get(dir_inode);
+    size_t i;
+    if (!d || !dir_slot(d, name, &i)) {
+        return 0;
+    }
+
+    int was_dirty = dir_is_dirty(d);
+    d->ents[i].inode = new_inode;
+    if (new_name) {
+        size_t old_size = dir_link_size(d, d->ents[i].name);
+        name_put(d->ents[i].name);
+        d->ents[i].name = name_get(new_name);
+        size_t new_size = dir_link_size(d, d->ents[i].name);
+        if (new_size != old_size) {
+            dir_layout(d, i);
+            d->rewrite = 1;
+        }
+    }
+    wal_dirent(d, i);
+    return dir_changed(d, i, was_dirty);
+}
+
+/* Check that a directory holds nothing besides . and .. */
+static int dir_is_empty(uint32_t dir_inode)
+{
+    Dir *d = dir_get(dir_inode);
+    if (!d) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < d->n; i++) {
+        if (d->ents[i].inode != DIRENT_TOMBSTONE &&
+            d->ents[i].name != NAME_DOT && d->ents[i].name != NAME_DOTDOT) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Create a directory inode containing . and .. */
+static int create_dir_inode(uint32_t new_inode, uint32_t parent_inode)
+{
+    Dir *d = dir_new();
+    if (!d) {
+        return 0;
+    }
+
+    d->inode = new_inode;
+    if (!dir_reserve(d, 2)) {
+        dir_free(d);
+        return 0;
+    }
+
+    d->ents[0].inode = new_inode;
+    d->ents[0].name = name_get(".");
+    d->ents[1].inode = parent_inode;
+    d->ents[1].name = name_get("..");
+    d->n = 2;
+    d->legacy = dir_version == 1;
+    dir_layout(d, 0);
+    wal_dir(d);
+
+    /* In the synchronous mode the file is created in place and kept
+       open; without a descriptor to spare it goes through the temp-file
+       path instead. With write-back the flusher writes it whole, off the
+       command path, and a durable mode must not touch it before the
+       commit anyway: the number may belong to a directory whose removal
+       a crash would undo. Nor may a file the latest snapshot still shares
+       be truncated. */
+    d->rewrite = writeback || snap_is_pending(new_inode);
+    if (!d->rewrite) {
+        sums_invalidate();
+        d->rewrite = dir_open_fd(d, O_CREAT | O_TRUNC) < 0;
+    }
+
+    dcache_insert(d, 1);
+
+    /* The number may still have a delete of its previous file queued */
+    if (writeback) {
+        wb_set_op(new_inode, OP_NONE, NULL);
+    }
+    return dir_changed(d, 0, 0);
+}
+
+/* Create a file inode and write the name into it */
+static int create_file_inode(uint32_t new_inode, const char *name)
+{
+    wal_file(new_inode, name);
+    if (!writeback) {
+        return write_file_inode(new_inode, name);
+    }
+
+    wb_set_op(new_inode, OP_CREATE_FILE, name);
+    return 1;
+}
+
+/* Delete an inode's backing file, now or on the next write-back */
+static void delete_inode_file(uint32_t inode)
+{
+    if (writeback) {
+        wb_set_op(inode, OP_UNLINK, NULL);
+        return;
+    }
+
+    io_submit_op(IO_UNLINK, inode, -1, 0, 0, NULL, 0);
+}
+
+/* Whether a host file name is an inode file's, and if so which inode */
+static int host_inode_file(const char *name, uint32_t *inode)
+{
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(name, &end, 10);
+    if (name[0] < '0' || name[0] > '9' || *end != '\0' || errno || n >= MAX_INODES) {
+        return 0;
+    }
+    *inode = (uint32_t)n;
+    return 1;
+}
+
+/* Claim an unused inode number for a new file or directory. A thread
+   scans the used bitmap from its own hint word and takes a clear bit with
+   compare-and-swap, so concurrent creates neither lock nor, usually, touch
+   the same word. Frees move the hint back towards the thread's home word;
+   the first thread's home is word 0, so a single session still gets the
+   lowest free number. */
+static int64_t alloc_inode(char type)
+{
+    if (alloc_home < 0) {
+        alloc_home = (int64_t)((atomic_fetch_add(&alloc_threads, 1) * ALLOC_SPREAD_WORDS) %
+                               INODE_WORDS);
+        alloc_hint = (uint32_t)alloc_home;
+    }
+
+    for (uint64_t n = 0; n < INODE_WORDS; n++) {
+        uint32_t w = (uint32_t)((alloc_hint + n) % INODE_WORDS);
+        InodeWord *word = iset_word(&inode_used_set, w * 64, 1);
+        if (!word) {
+            return -1;
+        }
+        uint64_t bits = atomic_load(word);
+
+        while (~bits != 0) {
+            int bit = __builtin_ctzll(~bits);
+            uint32_t inode = w * 64 + (uint32_t)bit;
+            if (inode >= MAX_INODES) {
+                break;
+            }
+            if (atomic_compare_exchange_weak(word, &bits, bits | ((uint64_t)1 << bit))) {
+                alloc_hint = w;
+                inode_set_type(inode, type);
+                mark_dirty();
+                return inode;
+            }
+        }
+    }
+    return -1;
+}
+
+/* Return an inode number to the allocator */
+static void free_inode(uint32_t inode)
+{
+    /* Logged before the number can be claimed again, so a later create
+       of it always follows in the journal */
+    wal_free(inode);
+    if (inode_type(inode) == 'd') {
+        cwd_pins_remove(inode);
+    }
+    inode_set_type(inode, 0);
+    inode_set_used(inode, 0);
+    mark_dirty();
+
+    uint32_t w = inode / 64;
+    if (w < alloc_hint && w >= alloc_home) {
+        alloc_hint = w;
+    }
+}
+
+/* Delete an inode's backing file and mark it free */
+static void release_inode(uint32_t inode)
+{
+    delete_inode_file(inode);
+    dir_forget(inode);
+    filemap_drop(inode);
+    free_inode(inode);
+}
+
+/* Growable list of inode numbers */
+typedef struct {
+    uint32_t *v;
+    size_t n, cap;
+} InodeList;
+
+static int inode_list_push(InodeList *l, uint32_t inode)
+{
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        uint32_t *v = realloc(l->v, cap * sizeof(uint32_t));
+        if (!v) {
+            return 0;
+        }
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->n++] = inode;
+    return 1;
+}
+
+/* Collect every inode reachable from root (root included) in one pass,
+   visiting each directory exactly once */
+static int collect_subtree(uint32_t root, InodeList *out)
+{
+    InodeSet *seen = iset_new();
+    if (!seen) {
+        return 0;
+    }
+
+    iset_put(seen, root, 1);
+    if (!inode_list_push(out, root)) {
+        iset_free(seen);
+        return 0;
+    }
+
+    /* out doubles as the work queue: directories are expanded in order */
+    for (size_t next = 0; next < out->n; next++) {
+        uint32_t dir = out->v[next];
+        if (inode_type(dir) != 'd') {
+            continue;
+        }
+
+        Dir *d = dir_get(dir);
+        if (!d) {
+            continue;
+        }
+
+        for (size_t i = 0; i < d->n; i++) {
+            const DirLink *ent = &d->ents[i];
+            if (ent->inode >= MAX_INODES || iset_has(seen, ent->inode) ||
+                !inode_used(ent->inode) ||
+                ent->name == NAME_DOT || ent->name == NAME_DOTDOT) {
+                continue;
+            }
+
+            iset_put(seen, ent->inode, 1);
+            if (!inode_list_push(out, ent->inode)) {
+                iset_free(seen);
+                return 0;
+            }
+        }
+    }
+
+    iset_free(seen);
+    return 1;
+}
+
+/* Slice of an inode list handled by one unlink worker */
+typedef struct {
+    const uint32_t *v;
+    size_t n;
+} UnlinkJob;
+
+static void unlink_range(const uint32_t *v, size_t n)
+{
+    char fname[16];
+    for (size_t i = 0; i < n; i++) {
+        snap_preserve(v[i]);
+        snprintf(fname, sizeof(fname), "%u", (unsigned)v[i]);
+        remove(fname);
+    }
+}
+
+static void *unlink_worker(void *arg)
+{
+    UnlinkJob *job = arg;
+    unlink_range(job->v, job->n);
+    return NULL;
+}
+
+/* Delete the backing files of a batch of inodes, splitting large
+   batches across threads */
+static void unlink_batch(const uint32_t *v, size_t n)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpu > 1 ? (size_t)ncpu : 1;
+    if (nthreads > RM_MAX_THREADS) {
+        nthreads = RM_MAX_THREADS;
+    }
+
+    if (n < RM_PARALLEL_MIN || nthreads == 1) {
+        unlink_range(v, n);
+        return;
+    }
+
+    pthread_t tid[RM_MAX_THREADS];
+    UnlinkJob jobs[RM_MAX_THREADS];
+    size_t chunk = (n + nthreads - 1) / nthreads;
+    size_t started = 0;
+
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t lo = t * chunk;
+        size_t hi = lo + chunk < n ? lo + chunk : n;
+        if (lo >= hi) {
+            break;
+        }
+        jobs[t].v = v + lo;
+        jobs[t].n = hi - lo;
+        if (pthread_create(&tid[t], NULL, unlink_worker, &jobs[t]) != 0) {
+            unlink_range(jobs[t].v, jobs[t].n);
+            continue;
+        }
+        tid[started++] = tid[t];
+    }
+
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(tid[t], NULL);
+    }
+}
+
+/* Redo one journal record. The inode's current state may be older or
+   newer than the record, since a checkpoint may have been cut short;
+   each record simply puts back the state it describes. */
+static void wal_apply(int type, const char *p, uint32_t len)
+{
+    uint32_t inode;
+    if (len < sizeof(uint32_t)) {
+        return;
+    }
+    memcpy(&inode, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    len -= sizeof(uint32_t);
+    if (inode >= MAX_INODES) {
+        return;
+    }
+
+    /* Older journals hold names NUL-padded to 32 bytes, and legacy
+       directory records; both still replay */
+    if (type == WAL_FILE && len > 0 && len <= NAME_LEN && inode != 0) {
+        char name[NAME_LEN + 1];
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        dir_forget(inode);
+        filemap_drop(inode);
+        inode_set_used(inode, 1);
+        inode_set_type(inode, 'f');
+        create_file_inode(inode, name);
+        filemap_create(inode);
+
+    } else if (type == WAL_DIR) {
+        int legacy;
+        size_t n;
+        if (dir_file_scan(p, len, &legacy, &n) != len || n < 2) {
+            return;
+        }
+
+        Dir *d = dir_new();
+        if (!d || !dir_reserve(d, n)) {
+            die("journal: out of memory");
+        }
+        d->inode = inode;
+        d->n = n;
+        d->legacy = legacy;
+        dir_file_decode(p, legacy, n, d->ents);
+        for (size_t i = 0; i < d->n; i++) {
+            if (d->ents[i].inode == DIRENT_TOMBSTONE) {
+                d->dead++;
+            }
+        }
+        dir_layout(d, 0);
+        d->rewrite = 1;
+
+        filemap_drop(inode);
+        inode_set_used(inode, 1);
+        inode_set_type(inode, 'd');
+        dcache_insert(d, 1);
+        wb_set_op(inode, OP_NONE, NULL);
+        dir_changed(d, 0, 0);
+
+    } else if (type == WAL_DIRENT && len > sizeof(uint32_t) + DIR_REC_HEAD) {
+        uint32_t slot;
+        memcpy(&slot, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+
+        /* No record in the current format is as long as a legacy one */
+        int legacy = len == sizeof(DirEnt);
+        if (!legacy && len != dir_rec_size((uint8_t)p[sizeof(uint32_t)])) {
+            return;
+        }
+
+        /* A torn directory file can be short; the gap is dead. A gap
+           wider than a journal's worth of records is a bad record. */
+        Dir *d = inode_type(inode) == 'd' ? dir_get(inode) : NULL;
+        if (!d || slot > d->n + WAL_CHECKPOINT_BYTES || !dir_reserve(d, (size_t)slot + 1)) {
+            return;
+        }
+
+        /* Gap records are zeroed, as a torn file reads */
+        int was_dirty = dir_is_dirty(d);
+        size_t first = slot < d->n ? slot : d->n;
+        while (d->n <= slot) {
+            d->ents[d->n].inode = DIRENT_TOMBSTONE;
+            d->ents[d->n++].name = name_get("");
+            d->dead++;
+        }
+        if (d->ents[slot].inode == DIRENT_TOMBSTONE) {
+            d->dead--;
+        }
+        size_t old_len = name_len(d->ents[slot].name);
+        name_put(d->ents[slot].name);
+        pthread_mutex_lock(&names_lock);
+        dir_rec_decode(p, legacy, &d->ents[slot]);
+        pthread_mutex_unlock(&names_lock);
+        if (d->ents[slot].inode == DIRENT_TOMBSTONE) {
+            d->dead++;
+        }
+        if (!d->legacy && dir_rec_size(name_len(d->ents[slot].name)) != dir_rec_size(old_len)) {
+            d->rewrite = 1;
+        }
+        dir_layout(d, first);
+        dir_changed(d, first, was_dirty);
+
+    } else if (type == WAL_FREE && len == 0 && inode != 0) {
+        release_inode(inode);
+
+    } else if (type == WAL_EXTENTS && len >= sizeof(uint64_t) &&
+               (len - sizeof(uint64_t)) % sizeof(Extent) == 0) {
+        if (inode_type(inode) != 'f') {
+            return;
+        }
+        FileMap *fm = filemap_find(inode);
+        if (!fm && !(fm = filemap_create(inode))) {
+            die("journal: out of memory");
+        }
+
+        /* The block bitmap is rebuilt once replay is done */
+        memcpy(&fm->size, p, sizeof(uint64_t));
+        fm->n = 0;
+        for (const char *e = p + sizeof(uint64_t); e < p + len; e += sizeof(Extent)) {
+            Extent ext;
+            memcpy(&ext, e, sizeof(Extent));
+            if (!filemap_push(fm, ext.start, ext.count)) {
+                die("journal: out of memory");
+            }
+        }
+    }
+}
+
+/* Recompute which data blocks are in use from the file maps */
+static void blocks_rebuild(void)
+{
+    pthread_mutex_lock(&data_lock);
+    if (block_bitmap) {
+        memset(block_bitmap, 0, ((size_t)data_blocks + 7) / 8);
+    }
+    block_rover = 0;
+    for (size_t b = 0; b < filemap_buckets; b++) {
+        for (FileMap *fm = filemaps[b]; fm; fm = fm->next) {
+            for (uint32_t i = 0; i < fm->n; i++) {
+                if (!blocks_mark(fm->ext[i].start, fm->ext[i].count, 1)) {
+                    die("journal: out of memory");
+                }
+            }
+        }
+    }
+    blocks_add_pins();
+    pthread_mutex_unlock(&data_lock);
+}
+
+/* Open the journal and redo every complete group of its generation on
+   top of the metadata files, then checkpoint so the journal starts out
+   empty. Runs at startup before any other thread exists. */
+static void wal_open(void)
+{
+    wal_fd = open("journal", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (wal_fd < 0) {
+        perror("journal");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(wal_fd, &st) != 0) {
+        perror("journal");
+        exit(1);
+    }
+    if (st.st_size == 0 && fsync(root_fd) != 0) {
+        perror("journal");
+    }
+
+    size_t len = (size_t)st.st_size;
+    char *buf = malloc(len ? len : 1);
+    if (!buf) {
+        die("journal: out of memory");
+    }
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = pread(wal_fd, buf + got, len - got, (off_t)got);
+        if (r <= 0) {
+            break;
+        }
+        got += (size_t)r;
+    }
+    len = got;
+
+    /* Before the first durable start the image may be anything a crash
+       left behind */
+    size_t groups = 0, records = 0;
+    wal_sweep = len == 0 || (len >= WAL_HEADER && memcmp(buf, WAL_SWEEP_MAGIC, 8) == 0);
+    if (len >= WAL_HEADER && (wal_sweep || memcmp(buf, WAL_MAGIC, 8) == 0)) {
+        memcpy(&wal_gen, buf + 8, sizeof(uint64_t));
+
+        /* Records are checked up to their group's commit record, and
+           applied only once that has matched */
+        size_t pos = WAL_HEADER, group = pos, n = 0;
+        while (len - pos >= 5) {
+            uint32_t rlen;
+            memcpy(&rlen, buf + pos + 1, sizeof(uint32_t));
+            if (rlen > len - pos - 5) {
+                break;
+            }
+
+            if (buf[pos] == WAL_COMMIT) {
+                uint64_t gen;
+                uint32_t sum;
+                if (rlen != sizeof(gen) + sizeof(sum)) {
+                    break;
+                }
+                memcpy(&gen, buf + pos + 5, sizeof(gen));
+                memcpy(&sum, buf + pos + 5 + sizeof(gen), sizeof(sum));
+                if (gen != wal_gen || sum != fnv1a(buf + group, pos - group)) {
+                    break;
+                }
+
+                for (size_t r = group; r < pos; ) {
+                    uint32_t l;
+                    memcpy(&l, buf + r + 1, sizeof(uint32_t));
+                    wal_apply(buf[r], buf + r + 5, l);
+                    r += 5 + l;
+                }
+                groups++;
+                records += n;
+                n = 0;
+                group = pos + 5 + rlen;
+            } else {
+                n++;
+            }
+            pos += 5 + rlen;
+        }
+    } else if (len > 0) {
+        fprintf(stderr, "journal: bad header, ignored\n");
+        wal_sweep = 1;
+    }
+    free(buf);
+
+    if (groups > 0) {
+        blocks_rebuild();
+        fprintf(stderr, "journal: replayed %zu records in %zu commits\n", records, groups);
+        save_state();
+    } else {
+        wal_checkpoint();
+    }
+}
+
+/* Guess an unlisted inode's type from its file: a directory starts with
+   its own "." record. Returns 0 if there is no file. */
+static char probe_inode_type(uint32_t inode)
+{
+    char *buf;
+    size_t len;
+    if (!io_read_file(inode, &buf, &len)) {
+        return 0;
+    }
+
+    int legacy;
+    size_t n;
+    char type = 'f';
+    if (dir_file_scan(buf, len, &legacy, &n) == len && n >= 2) {
+        const char *rec = legacy ? buf : buf + DIR_HEADER;
+        uint32_t first;
+        memcpy(&first, rec, sizeof(uint32_t));
+        rec += sizeof(uint32_t);
+        if (first == inode && (legacy ? strncmp(rec, ".", DIRENT_NAME_LEN) == 0
+                                      : rec[0] == 1 && rec[1] == '.')) {
+            type = 'd';
+        }
+    }
+    free(buf);
+    return type;
+}
+
+/* Journal replay restores every committed change, but a checkpoint cut
+   short after a failed journal write, a rollback cut short, or an image
+   from before the journal, can leave the inode list behind the
+   directories; the journal's header says when. Walk the tree from the
+   root: adopt entries whose inode the list does not know, drop entries
+   whose inode file never made it to disk, free listed inodes nothing
+   refers to and delete inode files no entry was written for. Each
+   directory is walked once, so over the cache budget it is dropped
+   again unless the walk changed it. Runs at startup before any other
+   thread exists. */
+static void recover_tree(void)
+{
+    InodeSet *seen = iset_new();
+    InodeList dirs = { NULL, 0, 0 };
+    unsigned adopted = 0, dropped = 0, freed = 0, stray = 0;
+
+    if (!seen || !inode_list_push(&dirs, 0)) {
+        die("recovery: out of memory");
+    }
+    iset_put(seen, 0, 1);
+
+    for (size_t next = 0; next < dirs.n; next++) {
+        uint32_t dir = dirs.v[next];
+        Dir *d = dir_get(dir);
+        if (!d) {
+            continue;
+        }
+
+        for (size_t i = 0; i < d->n; i++) {
+            DirLink *ent = &d->ents[i];
+            if (ent->inode == DIRENT_TOMBSTONE ||
+                ent->name == NAME_DOT || ent->name == NAME_DOTDOT) {
+                continue;
+            }
+
+            char type = 0;
+            if (ent->inode < MAX_INODES && !iset_has(seen, ent->inode)) {
+                type = inode_used(ent->inode) ? inode_type(ent->inode)
+                                              : probe_inode_type(ent->inode);
+            }
+
+            if (!type) {
+                int was_dirty = dir_is_dirty(d);
+                ent->inode = DIRENT_TOMBSTONE;
+                d->dead++;
+                wal_dirent(d, i);
+                dir_changed(d, i, was_dirty);
+                dropped++;
+                continue;
+            }
+
+            if (!inode_used(ent->inode)) {
+                inode_set_used(ent->inode, 1);
+                inode_set_type(ent->inode, type);
+                if (type == 'f' && !filemap_find(ent->inode)) {
+                    filemap_create(ent->inode);
+                }
+                adopted++;
+            }
+
+            iset_put(seen, ent->inode, 1);
+            if (type == 'd' && !inode_list_push(&dirs, ent->inode)) {
+                die("recovery: out of memory");
+            }
+        }
+
+        if (dcache_budget > 0 && atomic_load(&dcache_bytes) > dcache_budget) {
+            d->ref = 0;
+            dcache_evict(dir);
+        }
+    }
+
+    uint64_t pos = 0;
+    uint32_t i;
+    while (iset_next(&inode_used_set, &pos, &i)) {
+        if (!iset_has(seen, i)) {
+            release_inode(i);
+            freed++;
+        }
+    }
+
+    DIR *host = opendir(".");
+    struct dirent *de;
+    while (host && (de = readdir(host)) != NULL) {
+        if (host_inode_file(de->d_name, &i) && !inode_used(i) && !iset_has(seen, i)) {
+            delete_inode_file(i);
+            stray++;
+        }
+    }
+    if (host) {
+        closedir(host);
+    }
+
+    /* The sweep is done once a checkpoint says so */
+    wal_sweep = 0;
+    if (adopted || dropped || freed || stray) {
+        fprintf(stderr, "recovery: %u entries adopted, %u dropped, %u orphan inodes freed, "
+                "%u stray files deleted\n", adopted, dropped, freed, stray);
+        save_state();
+    } else {
+        wal_checkpoint();
+    }
+
+    free(dirs.v);
+    iset_free(seen);
+}
+
+/* Print the contents of the current directory */
+static void cmd_ls(Session *s)
+{
+    ns_enter(0);
+    lock_inode(s->cwd, 0);
+
+    Dir *d = dir_get(s->cwd);
+    if (!d) {
+        sess_perror(s, "ls");
+    } else {
+        for (size_t i = 0; i < d->n; i++) {
+            if (d->ents[i].inode == DIRENT_TOMBSTONE) {
+                continue;
+            }
+
+            fprintf(s->out, "%u %s\n", (unsigned)d->ents[i].inode,
+                    name_str(d->ents[i].name));
+        }
+    }
+
+    unlock_inode(s->cwd);
+    ns_leave();
+}
+
+/* Change the current working directory */
+static void cmd_cd(Session *s, const char *name)
+{
+    DirLink ent;
+
+    ns_enter(0);
+    lock_inode(s->cwd, 0);
+
+    if (!dir_find(s->cwd, name, &ent)) {
+        fprintf(s->err, "cd: no such directory\n");
+    } else if (ent.inode >= MAX_INODES || !inode_used(ent.inode) ||
+               inode_type(ent.inode) != 'd') {
+        fprintf(s->err, "cd: not a directory\n");
+    } else {
+        unlock_inode(s->cwd);
+        session_set_cwd(s, ent.inode);
+        ns_leave();
+        return;
+    }
+
+    unlock_inode(s->cwd);
+    ns_leave();
+}
+
+/* A name to create in a directory, and what became of it */
+typedef struct {
+    const char *name;
+    uint32_t key;       /* interned name, NAME_NONE if too long */
+    int64_t inode;      /* the new inode, or -1 */
+    const char *err;    /* why it was not created; NULL if it was, or was skipped */
+} NewEntry;
+
+/* Mark the names dir already holds, or that appear earlier in e, as
+   existing: one pass over the directory, looking each entry's name up in
+   a hash table of the wanted names. Sets exists[i] for each. */
+static void find_existing(const Dir *d, const NewEntry *e, size_t n, char *exists)
+{
+    uint32_t small[16];
+    size_t size = 2;
+    while (size < 2 * n) {
+        size *= 2;
+    }
+    uint32_t *slots = size <= 16 ? small : malloc(size * sizeof(uint32_t));
+    if (!slots) {
+        die("create: out of memory");
+    }
+    memset(slots, 0, size * sizeof(uint32_t));
+
+    /* Slots hold an index into e plus one */
+    for (size_t i = 0; i < n; i++) {
+        exists[i] = 0;
+        if (e[i].key == NAME_NONE) {
+            continue;
+        }
+        size_t h = (e[i].key * 2654435761u) & (size - 1);
+        while (slots[h] && e[slots[h] - 1].key != e[i].key) {
+            h = (h + 1) & (size - 1);
+        }
+        if (slots[h]) {
+            exists[i] = 1;
+        } else {
+            slots[h] = (uint32_t)i + 1;
+        }
+    }
+
+    for (size_t k = 0; k < d->n; k++) {
+        if (d->ents[k].inode == DIRENT_TOMBSTONE) {
+            continue;
+        }
+        size_t h = (d->ents[k].name * 2654435761u) & (size - 1);
+        while (slots[h] && e[slots[h] - 1].key != d->ents[k].name) {
+            h = (h + 1) & (size - 1);
+        }
+        if (slots[h]) {
+            exists[slots[h] - 1] = 1;
+        }
+    }
+
+    if (slots != small) {
+        free(slots);
+    }
+}
+
+/* Add new files or directories called e[0..n).name to dir, which the
+   caller holds exclusively. A name may not be empty or contain '/', which
+   separates path components. Names dir already holds are skipped if
+   skip_existing, else fail with "already exists". The new inode files
+   and the directory's new records go out as one linked batch, the
+   records in a single write after the files they point to; if any of it
+   fails, none of the names is created: the journal records are held back
+   until the batch has run and dropped, and the new inodes' files deleted.
+   Each entry gets its new inode, or -1 and err. */
+static void create_entries(uint32_t dir, NewEntry *e, size_t n, char type, int skip_existing)
+{
+    char *exists = malloc(n);
+    if (!exists) {
+        die("create: out of memory");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        e[i].inode = -1;
+        e[i].err = NULL;
+        e[i].key = NAME_NONE;
+        size_t len = strlen(e[i].name);
+        if (len == 0 || memchr(e[i].name, '/', len)) {
+            e[i].err = "invalid name";
+        } else if (len > NAME_LEN) {
+            e[i].err = "name too long";
+        } else {
+            e[i].key = name_get(e[i].name);
+        }
+    }
+
+    Dir *d = dir_get(dir);
+    if (d) {
+        find_existing(d, e, n, exists);
+    }
+
+    /* Inode numbers come from the allocator's hint word, so a run of
+       creates takes consecutive free numbers */
+    size_t want = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (e[i].key == NAME_NONE) {
+            continue;
+        }
+        if (!d) {
+            e[i].err = strerror(errno);
+        } else if (exists[i]) {
+            e[i].err = skip_existing ? NULL : "already exists";
+        } else if ((e[i].inode = alloc_inode(type)) < 0) {
+            e[i].err = "no free inodes";
+        } else {
+            want++;
+        }
+    }
+    free(exists);
+
+    int ok = 1;
+    size_t first = d ? d->n : 0;
+    if (want > 0 && !dir_reserve(d, d->n + want)) {
+        errno = ENOMEM;
+        ok = 0;
+    }
+
+    IoBatch batch = { NULL, 0, 0, 1, 0 };
+    if (ok && want > 0) {
+        wal_stage_begin();
+        io_batch = &batch;
+        for (size_t i = 0; ok && i < n; i++) {
+            if (e[i].inode >= 0) {
+                uint32_t ino = (uint32_t)e[i].inode;
+                ok = type == 'd' ? create_dir_inode(ino, dir) : create_file_inode(ino, e[i].name);
+            }
+        }
+
+        /* The records take over the names' references */
+        if (ok) {
+            int was_dirty = dir_is_dirty(d);
+            for (size_t i = 0; i < n; i++) {
+                if (e[i].inode >= 0) {
+                    d->ents[d->n].inode = (uint32_t)e[i].inode;
+                    d->ents[d->n].name = e[i].key;
+                    d->ents[d->n].off = (uint32_t)d->bytes;
+                    d->bytes += dir_link_size(d, e[i].key);
+                    e[i].key = NAME_NONE;
+                    d->n++;
+                    wal_dirent(d, d->n - 1);
+                }
+            }
+            ok = dir_changed(d, first, was_dirty);
+        }
+        io_batch = NULL;
+
+        if (ok && iob_run(&batch) > 0) {
+            errno = -batch.ops[batch.n - 1].res;
+            for (size_t i = 0; i < batch.n; i++) {
+                if (batch.ops[i].res != 0 && batch.ops[i].res != -ECANCELED) {
+                    errno = -batch.ops[i].res;
+                    break;
+                }
+            }
+            ok = 0;
+        }
+        iob_free(&batch);
+        wal_stage_end(ok);
+    }
+
+    if (!ok) {
+        const char *err = strerror(errno);
+        if (d->n > first) {
+            dir_unappend(d, first);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (e[i].inode >= 0) {
+                delete_inode_file((uint32_t)e[i].inode);
+                dir_forget((uint32_t)e[i].inode);
+                free_inode((uint32_t)e[i].inode);
+                e[i].inode = -1;
+                e[i].err = err;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (e[i].key != NAME_NONE) {
+            name_put(e[i].key);
+        }
+        if (type == 'f' && e[i].inode >= 0) {
+            filemap_create((uint32_t)e[i].inode);
+        }
+    }
+}
+
+/* Add a new file or directory called name to dir, which the caller holds
+   exclusively. Returns the new inode, or -1 with errmsg set. */
+static int create_entry(uint32_t dir, const char *name, char type,
+                        const char **errmsg)
+{
+    NewEntry e = { name, NAME_NONE, -1, NULL };
+    create_entries(dir, &e, 1, type, 0);
+    *errmsg = e.err;
+    return (int)e.inode;
+}
+
+/* Create new files or directories called names[0..n) in the current
+   directory. A single name's error is reported as before; with several,
+   each error names its name. */
+static void create_in_cwd(Session *s, const char *cmd, const char **names, size_t n,
+                          char type)
+{
+    NewEntry *e = malloc(n * sizeof(NewEntry));
+    if (!e) {
+        fprintf(s->err, "%s: out of memory\n", cmd);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        e[i].name = names[i];
+    }
+
+    ns_enter(0);
+    lock_inode(s->cwd, 1);
+    create_entries(s->cwd, e, n, type, type == 'f');
+    unlock_inode(s->cwd);
+    ns_leave();
+
+    for (size_t i = 0; i < n; i++) {
+        if (!e[i].err) {
+            continue;
+        }
+        if (n == 1) {
+            fprintf(s->err, "%s: %s\n", cmd, e[i].err);
+        } else {
+            fprintf(s->err, "%s: %s: %s\n", cmd, e[i].name, e[i].err);
+        }
+    }
+    free(e);
+}
+
+/* Create new directories in the current directory */
+static void cmd_mkdir(Session *s, const char **names, size_t n)
+{
+    create_in_cwd(s, "mkdir", names, n, 'd');
+}
+
+/* Create new files in the current directory; existing names are left
+   alone */
+static void cmd_touch(Session *s, const char **names, size_t n)
+{
+    create_in_cwd(s, "touch", names, n, 'f');
+}
+
+/* Check for the names every directory holds for itself and its parent */
+static int is_dot_name(const char *name)
+{
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/* Resolve a slash-separated path to an inode. Absolute paths start at
+   inode 0, relative ones at cwd. */
+static int lookup_path(uint32_t cwd, const char *path, uint32_t *out)
+{
+    uint32_t cur = (path[0] == '/') ? 0 : cwd;
+    const char *p = path;
+
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+
+        size_t len = strcspn(p, "/");
+        char comp[NAME_LEN + 1];
+        if (len > NAME_LEN) {
+            return 0;
+        }
+        memcpy(comp, p, len);
+        comp[len] = '\0';
+        p += strcspn(p, "/");
+
+        if (cur >= MAX_INODES || !inode_used(cur) ||
+            inode_type(cur) != 'd') {
+            return 0;
+        }
+
+        DirLink ent;
+        if (!dir_find(cur, comp, &ent) || ent.inode >= MAX_INODES ||
+            !inode_used(ent.inode)) {
+            return 0;
+        }
+        cur = ent.inode;
+    }
+
+    *out = cur;
+    return 1;
+}
+
+/* Split a path into the directory that holds its last component and the
+   component itself. Trailing slashes are ignored. */
+static int lookup_parent(uint32_t cwd, const char *path,
+                         uint32_t *parent, char leaf[NAME_LEN + 1])
+{
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+
+    size_t len = end - start;
+    if (len == 0 || len > NAME_LEN) {
+        return 0;
+    }
+    memcpy(leaf, path + start, len);
+    leaf[len] = '\0';
+
+    if (start == 0) {
+        *parent = cwd;
+        return 1;
+    }
+
+    char *dir = malloc(start + 1);
+    if (!dir) {
+        return 0;
+    }
+    memcpy(dir, path, start);
+    dir[start] = '\0';
+
+    int ok = lookup_path(cwd, dir, parent) && inode_type(*parent) == 'd';
+    free(dir);
+    return ok;
+}
+
+/* Check whether dir is ancestor itself or lies somewhere below it */
+static int is_under(uint32_t dir, uint32_t ancestor)
+{
+    size_t steps = 0;
+
+    while (steps++ < MAX_INODES) {
+        if (dir == ancestor) {
+            return 1;
+        }
+        if (dir == 0) {
+            return 0;
+        }
+
+        DirLink ent;
+        if (!dir_find(dir, "..", &ent) || ent.inode >= MAX_INODES) {
+            return 0;
+        }
+        dir = ent.inode;
+    }
+    return 1;
+}
+
+/* Remove a directory and everything below it: the parent entry is
+   dropped first, then the whole subtree is freed in one pass */
+static void remove_tree(Session *s, const char *name, uint32_t root)
+{
+    InodeList list = { NULL, 0, 0 };
+
+    if (!collect_subtree(root, &list)) {
+        fprintf(s->err, "rm: out of memory\n");
+        free(list.v);
+        return;
+    }
+
+    if (!dir_remove(s->cwd, name, NULL)) {
+        sess_perror(s, "rm");
+        free(list.v);
+        return;
+    }
+
+    for (size_t i = 0; i < list.n; i++) {
+        if (inode_type(list.v[i]) == 'd') {
+            dir_forget(list.v[i]);
+        }
+        filemap_drop(list.v[i]);
+    }
+
+    for (size_t i = 0; i < list.n; i++) {
+        free_inode(list.v[i]);
+    }
+
+    /* The host files go once nothing on disk refers to them any more */
+    save_state();
+    unlink_batch(list.v, list.n);
+    free(list.v);
+}
+
+/* Remove a file (or, with -r, a whole directory) from the current directory */
+static void cmd_rm(Session *s, const char *name, int recursive)
+{
+    DirLink ent;
+
+    /* rm -r frees a whole subtree, so it locks out every other command */
+    ns_enter(recursive);
+    lock_inode(s->cwd, 1);
+
+    if (is_dot_name(name) || !dir_find(s->cwd, name, &ent)) {
+        fprintf(s->err, "rm: no such file\n");
+    } else if (ent.inode >= MAX_INODES || !inode_used(ent.inode)) {
+        fprintf(s->err, "rm: invalid inode\n");
+    } else if (inode_type(ent.inode) == 'd') {
+        if (recursive) {
+            remove_tree(s, name, ent.inode);
+        } else {
+            fprintf(s->err, "rm: is a directory\n");
+        }
+    } else if (!dir_remove(s->cwd, name, NULL)) {
+        sess_perror(s, "rm");
+    } else {
+        release_inode(ent.inode);
+    }
+
+    unlock_inode(s->cwd);
+    ns_leave();
+}
+
+/* Remove an empty directory from the current directory */
+static void cmd_rmdir(Session *s, const char *name)
+{
+    DirLink ent;
+
+    if (is_dot_name(name)) {
+        fprintf(s->err, "rmdir: invalid argument\n");
+        return;
+    }
+
+    ns_enter(0);
+    lock_inode(s->cwd, 0);
+    int found = dir_find(s->cwd, name, &ent);
+    unlock_inode(s->cwd);
+
+    if (!found) {
+        fprintf(s->err, "rmdir: no such directory\n");
+        ns_leave();
+        return;
+    }
+
+    /* Both the parent and the directory itself change; relock the pair in
+       stripe order and make sure the name still refers to the same inode */
+    uint32_t child = ent.inode;
+    lock_inode_pair(s->cwd, child);
+
+    if (!dir_find(s->cwd, name, &ent) || ent.inode != child) {
+        fprintf(s->err, "rmdir: no such directory\n");
+    } else if (ent.inode >= MAX_INODES || !inode_used(ent.inode) ||
+               inode_type(ent.inode) != 'd') {
+        fprintf(s->err, "rmdir: not a directory\n");
+    } else if (!dir_is_empty(ent.inode)) {
+        fprintf(s->err, "rmdir: directory not empty\n");
+    } else if (!dir_remove(s->cwd, name, NULL)) {
+        sess_perror(s, "rmdir");
+    } else {
+        release_inode(ent.inode);
+    }
+
+    unlock_inode_pair(s->cwd, child);
+    ns_leave();
+}
+
+/* Rename or move an entry. Only directory entries are rewritten; a
+   moved directory additionally gets its .. entry pointed at the new parent.
+   The caller holds the namespace lock exclusively. */
+static void mv_locked(Session *s, const char *src, const char *dst)
+{
+    uint32_t src_dir, dst_dir, target;
+    char src_name[NAME_LEN + 1], dst_name[NAME_LEN + 1];
+    DirLink ent;
+
+    if (!lookup_parent(s->cwd, src, &src_dir, src_name) ||
+        is_dot_name(src_name) || !dir_find(src_dir, src_name, &ent) ||
+        ent.inode >= MAX_INODES || !inode_used(ent.inode)) {
+        fprintf(s->err, "mv: no such file or directory\n");
+        return;
+    }
+
+    if (lookup_path(s->cwd, dst, &target) && inode_type(target) == 'd') {
+        dst_dir = target;
+        strcpy(dst_name, src_name);
+    } else if (!lookup_parent(s->cwd, dst, &dst_dir, dst_name) ||
+               is_dot_name(dst_name)) {
+        fprintf(s->err, "mv: invalid destination\n");
+        return;
+    }
+
+    if (dir_find(dst_dir, dst_name, NULL)) {
+        if (dst_dir != src_dir || strcmp(dst_name, src_name) != 0) {
+            fprintf(s->err, "mv: destination exists\n");
+        }
+        return;
+    }
+
+    int is_dir = inode_type(ent.inode) == 'd';
+
+    if (dst_dir == src_dir) {
+        if (!dir_update(src_dir, src_name, ent.inode, dst_name)) {
+            sess_perror(s, "mv");
+        }
+        return;
+    }
+
+    if (is_dir && is_under(dst_dir, ent.inode)) {
+        fprintf(s->err, "mv: cannot move a directory into itself\n");
+        return;
+    }
+
+    /* Link into the destination before unlinking from the source, so an
+       interrupted move leaves two names rather than none */
+    if (!dir_append(dst_dir, ent.inode, dst_name)) {
+        sess_perror(s, "mv");
+        return;
+    }
+
+    if (!dir_remove(src_dir, src_name, NULL)) {
+        sess_perror(s, "mv");
+        return;
+    }
+
+    if (is_dir && !dir_update(ent.inode, "..", dst_dir, NULL)) {
+        sess_perror(s, "mv");
+    }
+}
+
+static void cmd_mv(Session *s, const char *src, const char *dst)
+{
+    ns_enter(1);
+    mv_locked(s, src, dst);
+    ns_leave();
+}
+
+/* Copy a file inode's own host file to a session's output, for files
+   without a map */
+static int copy_inode_file(uint32_t inode, Session *s)
+{
+    char fname[16];
+    snprintf(fname, sizeof(fname), "%u", (unsigned)inode);
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    int ok = fstat(fd, &st) == 0 && stream_out(fd, 0, (uint64_t)st.st_size, s);
+
+    close(fd);
+    return ok;
+}
+
+/* Give a file without a map one, seeded with its inode file's contents */
+static FileMap *adopt_inode_file(uint32_t inode)
+{
+    FileMap *fm = filemap_create(inode);
+    if (!fm) {
+        return NULL;
+    }
+
+    char fname[16];
+    snprintf(fname, sizeof(fname), "%u", (unsigned)inode);
+
+    FILE *f = fopen(fname, "rb");
+    if (!f) {
+        return fm;
+    }
+
+    char *buf = malloc(IO_CHUNK);
+    size_t r;
+    while (buf && (r = fread(buf, 1, IO_CHUNK, f)) > 0) {
+        if (!filemap_write(fm, fm->size, buf, r)) {
+            break;
+        }
+    }
+
+    free(buf);
+    fclose(f);
+    return fm;
+}
+
+/* Replace (or append to) a file's contents with a line of text, creating
+   the file if needed */
+static void cmd_write(Session *s, const char *name, const char *text, int append)
+{
+    const char *cmd = append ? "append" : "write";
+    const char *err;
+    DirLink ent;
+    int excl = 0;
+
+    ns_enter(0);
+
+    /* Creating the file or its map changes the directory, in which case
+       the lookup is redone with the directory held exclusively */
+relock:
+    lock_inode(s->cwd, excl);
+
+    if (!dir_find(s->cwd, name, &ent)) {
+        if (!excl) {
+            unlock_inode(s->cwd);
+            excl = 1;
+            goto relock;
+        }
+        int ino = create_entry(s->cwd, name, 'f', &err);
+        if (ino < 0) {
+            fprintf(s->err, "%s: %s\n", cmd, err);
+            goto out;
+        }
+        ent.inode = (uint32_t)ino;
+    }
+
+    if (ent.inode >= MAX_INODES || !inode_used(ent.inode) ||
+        inode_type(ent.inode) != 'f') {
+        fprintf(s->err, "%s: not a file\n", cmd);
+        goto out;
+    }
+
+    FileMap *fm = filemap_find(ent.inode);
+    if (!fm) {
+        if (!excl) {
+            unlock_inode(s->cwd);
+            excl = 1;
+            goto relock;
+        }
+        fm = append ? adopt_inode_file(ent.inode) : filemap_create(ent.inode);
+        if (!fm) {
+            fprintf(s->err, "%s: out of memory\n", cmd);
+            goto out;
+        }
+    }
+
+    size_t len = strlen(text);
+    char *buf = malloc(len + 1);
+    if (!buf) {
+        fprintf(s->err, "%s: out of memory\n", cmd);
+        goto out;
+    }
+    memcpy(buf, text, len);
+    buf[len] = '\n';
+
+    pthread_rwlock_wrlock(&fm->lock);
+    if (!append) {
+        filemap_truncate(fm);
+    }
+    if (!filemap_write(fm, fm->size, buf, len + 1)) {
+        sess_perror(s, cmd);
+    }
+    pthread_rwlock_unlock(&fm->lock);
+    free(buf);
+
+out:
+    unlock_inode(s->cwd);
+    ns_leave();
+}
+
+/* Print a file's contents */
+static void cmd_cat(Session *s, const char *name)
+{
+    DirLink ent;
+
+    ns_enter(0);
+    lock_inode(s->cwd, 0);
+
+    if (!dir_find(s->cwd, name, &ent)) {
+        fprintf(s->err, "cat: no such file\n");
+    } else if (ent.inode >= MAX_INODES || !inode_used(ent.inode) ||
+               inode_type(ent.inode) != 'f') {
+        fprintf(s->err, "cat: not a file\n");
+    } else {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        FileMap *fm = filemap_find(ent.inode);
+        int ok;
+        if (fm) {
+            pthread_rwlock_rdlock(&fm->lock);
+            ok = filemap_cat(fm, s);
+            pthread_rwlock_unlock(&fm->lock);
+        } else {
+            ok = copy_inode_file(ent.inode, s);
+        }
+
+        if (!ok) {
+            sess_perror(s, "cat");
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            stats.cat_calls++;
+            stats.cat_ns += (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000u +
+                            (uint64_t)t1.tv_nsec - (uint64_t)t0.tv_nsec;
+        }
+    }
+
+    unlock_inode(s->cwd);
+    ns_leave();
+}
+
+/* Print I/O counters gathered so far */
+static void cmd_stats(Session *s)
+{
+    double secs = (double)stats.cat_ns / 1e9;
+    double mbps = secs > 0 ? (double)stats.cat_bytes / secs / 1e6 : 0.0;
+
+    fprintf(s->out, "cat: %llu calls, %llu bytes (%llu zero-copy), %.3f s, %.1f MB/s\n",
+            (unsigned long long)stats.cat_calls,
+            (unsigned long long)stats.cat_bytes,
+            (unsigned long long)stats.cat_zero_copy_bytes, secs, mbps);
+
+    pthread_mutex_lock(&dcache_lock);
+    size_t dirs = dcache_count;
+    pthread_mutex_unlock(&dcache_lock);
+    fprintf(s->out, "dir cache: %zu dirs, %zu bytes, budget %zu, %llu evictions\n",
+            dirs, atomic_load(&dcache_bytes), dcache_budget,
+            (unsigned long long)stats.dir_evictions);
+
+    pthread_mutex_lock(&names_lock);
+    size_t names = name_count;
+    size_t name_bytes = (((size_t)name_next + (1u << NAME_PAGE_SHIFT) - 1) >> NAME_PAGE_SHIFT) *
+                        (sizeof(NameRec) << NAME_PAGE_SHIFT) +
+                        (name_table ? name_table->buckets * sizeof(uint32_t) : 0);
+    pthread_mutex_unlock(&names_lock);
+    fprintf(s->out, "names: %zu interned, %zu bytes\n", names, name_bytes);
+}
+
+/* Write all pending changes out now */
+static void cmd_sync(void)
+{
+    ns_enter(1);
+    save_state();
+    ns_leave();
+}
+
+/* Snapshot names become directory names and may not be hidden */
+static int snap_name_ok(const char *name)
+{
+    return name[0] != '\0' && name[0] != '.' && strlen(name) <= SNAP_NAME_LEN &&
+           strchr(name, '/') == NULL;
+}
+
+static FileMap *snap_map(uint32_t inode, uint64_t size)
+{
+    (void)inode;
+    (void)size;
+    return NULL;
+}
+
+static void snap_pin_extent(FileMap *fm, Extent e)
+{
+    (void)fm;
+    if (!blocks_pin(e.start, e.count)) {
+        die("snapshot: out of memory");
+    }
+}
+
+/* An inode of the latest snapshot not linked into it yet is still shared */
+static void snap_mark_pending(uint32_t inode)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "snapshots/%s/%u", snap_names[snap_count - 1], (unsigned)inode);
+    if (access(path, F_OK) != 0) {
+        iset_put(&snap_pending, inode, 1);
+    }
+}
+
+/* Load the list of snapshots at startup, pinning the blocks they use */
+static void snap_load(void)
+{
+    FILE *f = fopen("snapshots/.order", "r");
+    if (!f) {
+        return;
+    }
+
+    char line[SNAP_NAME_LEN + 2], path[64];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(path, sizeof(path), "snapshots/%s", line);
+        if (!snap_name_ok(line) || !is_directory(path)) {
+            continue;
+        }
+
+        char (*names)[SNAP_NAME_LEN + 1] = realloc(snap_names, (snap_count + 1) * sizeof(*snap_names));
+        if (!names) {
+            die("snapshot: out of memory");
+        }
+        snap_names = names;
+        strcpy(snap_names[snap_count++], line);
+
+        snprintf(path, sizeof(path), "snapshots/%s/extents", line);
+        read_extents(path, snap_map, snap_pin_extent);
+    }
+    fclose(f);
+
+    if (snap_count > 0) {
+        snprintf(path, sizeof(path), "snapshots/%s/inodes_list", snap_names[snap_count - 1]);
+        InodeSet *used = iset_new(), *dirs = iset_new();
+        if (!used || !dirs) {
+            die("snapshot: out of memory");
+        }
+        if (read_inodes_list(path, used, dirs, NULL)) {
+            uint64_t pos = 0;
+            uint32_t i;
+            while (iset_next(used, &pos, &i)) {
+                snap_mark_pending(i);
+            }
+        }
+        iset_free(used);
+        iset_free(dirs);
+    }
+}
+
+/* Take a snapshot of the whole tree. Only the inode list and extent
+   table are linked now; inode files are linked in as they change. */
+static void cmd_snapshot(Session *s, const char *name)
+{
+    if (!snap_name_ok(name)) {
+        fprintf(s->err, "snapshot: invalid name\n");
+        return;
+    }
+
+    ns_enter(1);
+
+    /* The files on disk must match memory before they are shared */
+    save_state();
+
+    char dir[64], path[64];
+    snprintf(dir, sizeof(dir), "snapshots/%s", name);
+
+    char (*names)[SNAP_NAME_LEN + 1] = realloc(snap_names, (snap_count + 1) * sizeof(*snap_names));
+    if (!names) {
+        fprintf(s->err, "snapshot: out of memory\n");
+        ns_leave();
+        return;
+    }
+    snap_names = names;
+
+    if ((mkdir("snapshots", 0755) != 0 && errno != EEXIST) || mkdir(dir, 0755) != 0) {
+        if (errno == EEXIST) {
+            fprintf(s->err, "snapshot: already exists\n");
+        } else {
+            sess_perror(s, "snapshot");
+        }
+        ns_leave();
+        return;
+    }
+
+    snprintf(path, sizeof(path), "snapshots/%s/inodes_list", name);
+    int ok = link("inodes_list", path) == 0;
+    snprintf(path, sizeof(path), "snapshots/%s/extents", name);
+    ok = ok && (link("extents", path) == 0 || errno == ENOENT);
+
+    int fd = ok ? open("snapshots/.order", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) : -1;
+    if (fd < 0 || dprintf(fd, "%s\n", name) < 0 || !durable_sync(fd)) {
+        ok = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        sess_perror(s, "snapshot");
+        ns_leave();
+        return;
+    }
+
+    /* Every inode in use now is shared until its file first changes, and
+       every block in use now stays put */
+    iset_copy(&snap_pending, &inode_used_set);
+    pthread_mutex_lock(&data_lock);
+    for (uint32_t b = 0; b < data_blocks; b++) {
+        if (block_used(b) && !blocks_pin(b, 1)) {
+            fprintf(s->err, "snapshot: out of memory\n");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&data_lock);
+
+    strcpy(snap_names[snap_count++], name);
+    atomic_store(&snap_unsynced, 1);
+    durable_barrier("snapshot");
+    ns_leave();
+}
+
+/* Copy a host file, sharing its blocks where the file system can */
+static int copy_host_file(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return 0;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0) {
+        close(in);
+        return 0;
+    }
+
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, IO_CHUNK, 0)) > 0) {
+    }
+
+    /* Fall back to plain reads and writes where copying is refused */
+    if (n < 0) {
+        char buf[4096];
+        off_t pos = lseek(out, 0, SEEK_CUR);
+        while ((n = read(in, buf, sizeof(buf))) > 0 &&
+               pwrite_full(out, buf, (size_t)n, pos) == 0) {
+            pos += n;
+        }
+    }
+
+    int ok = n == 0 && durable_sync(out);
+    close(in);
+    if (close(out) != 0) {
+        ok = 0;
+    }
+    return ok;
+}
+
+/* Forget all in-memory metadata, before another version is loaded */
+static void state_reset(void)
+{
+    /* Every Dir goes, so the slabs and the name pool are freed whole
+       instead of one by one */
+    pthread_mutex_lock(&dcache_lock);
+    for (size_t b = 0; b < dcache_buckets; b++) {
+        while (dcache[b]) {
+            Dir *d = dcache[b];
+            dcache[b] = d->next;
+            dir_close_fd(d);
+            if (d->cap > SLAB_MAX_ENTS) {
+                free(d->ents);
+            }
+            free(d->dirty);
+        }
+    }
+    dcache_count = 0;
+    atomic_store(&dcache_bytes, 0);
+    slab_reset();
+    names_reset();
+    pthread_mutex_unlock(&dcache_lock);
+
+    pthread_mutex_lock(&data_lock);
+    for (size_t b = 0; b < filemap_buckets; b++) {
+        while (filemaps[b]) {
+            FileMap *fm = filemaps[b];
+            filemaps[b] = fm->next;
+            pthread_rwlock_destroy(&fm->lock);
+            free(fm->ext);
+            free(fm);
+        }
+    }
+    filemap_count = 0;
+    if (block_bitmap) {
+        memset(block_bitmap, 0, ((size_t)data_blocks + 7) / 8);
+    }
+    block_rover = 0;
+    blocks_add_pins();
+    pthread_mutex_unlock(&data_lock);
+
+    iset_clear(&inode_used_set);
+    iset_clear(&inode_dir_set);
+
+    /* Directory numbers may mean other directories from here on */
+    cwd_pins_remove(MAX_INODES);
+}
+
+/* Copy a snapshot's file (or, if it did not change before the next
+   snapshot, that one's) over a live file */
+static int snap_restore_file(size_t snap, const char *file)
+{
+    char from[64], tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+    for (size_t i = snap; i < snap_count; i++) {
+        snprintf(from, sizeof(from), "snapshots/%s/%s", snap_names[i], file);
+        if (access(from, F_OK) != 0) {
+            continue;
+        }
+        if (!copy_host_file(from, tmp) || rename(tmp, file) != 0) {
+            unlink(tmp);
+            return 0;
+        }
+        return 1;
+    }
+
+    errno = ENOENT;
+    return 0;
+}
+
+/* Return the whole tree to a snapshot. First the latest snapshot gets a
+   link to every file it still shares, so that none depends on the live
+   files any more; then the snapshot's lists and inode files are copied
+   back. Interrupted by a crash, it can simply be run again. */
+static void cmd_rollback(Session *s, const char *name)
+{
+    ns_enter(1);
+
+    size_t snap = 0;
+    while (snap < snap_count && strcmp(snap_names[snap], name) != 0) {
+        snap++;
+    }
+    if (snap == snap_count) {
+        fprintf(s->err, "rollback: no such snapshot\n");
+        ns_leave();
+        return;
+    }
+
+    save_state();
+    uint64_t pos = 0;
+    uint32_t i;
+    while (iset_next(&snap_pending, &pos, &i)) {
+        snap_preserve(i);
+    }
+    durable_barrier("snapshot");
+
+    /* The files copied back have no sums until the next save */
+    sums_invalidate();
+    free(dir_sums);
+    dir_sums = NULL;
+    dir_nsums = 0;
+    sums_nnoted = 0;
+    ilist_sum_known = 0;
+
+    /* The journal cannot redo a rollback cut short */
+    if (wal_fd >= 0) {
+        wal_mark_sweep();
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "snapshots/%s/extents", name);
+    if (!snap_restore_file(snap, "inodes_list") ||
+        (access(path, F_OK) == 0 ? !snap_restore_file(snap, "extents")
+                                 : unlink("extents") != 0 && errno != ENOENT)) {
+        sess_perror(s, "rollback");
+        ns_leave();
+        return;
+    }
+
+    state_reset();
+    load_inodes_list();
+    load_extents();
+
+    /* Inode files the snapshot has no inode for go first */
+    DIR *host = opendir(".");
+    struct dirent *de;
+    while (host && (de = readdir(host)) != NULL) {
+        if (host_inode_file(de->d_name, &i) && !inode_used(i)) {
+            unlink(de->d_name);
+        }
+    }
+    if (host) {
+        closedir(host);
+    }
+
+    pos = 0;
+    while (iset_next(&inode_used_set, &pos, &i)) {
+        char fname[16];
+        snprintf(fname, sizeof(fname), "%u", (unsigned)i);
+        if (!snap_restore_file(snap, fname)) {
+            fprintf(s->err, "rollback: inode %u: %s\n", (unsigned)i, strerror(errno));
+        }
+    }
+
+    durable_barrier("rollback");
+    if (wal_fd >= 0) {
+        wal_checkpoint();
+    }
+    atomic_store(&state_dirty, 0);
+    session_set_cwd(s, 0);
+    ns_leave();
+}
+
+/* With --durability command, commit whatever the command changed before
+   its output goes back. Commands finishing together on several threads
+   share one commit: the first to get the lock commits for all of them. */
+static void commit_command(void)
+{
+    if (durability != DUR_COMMAND || !atomic_load(&state_dirty)) {
+        return;
+    }
+
+    ns_enter(1);
+    if (atomic_load(&state_dirty)) {
+        commit_state();
+    }
+    ns_leave();
+}
+
+/* Evict cold directories until the cache fits its budget. The sweep
+   stops other commands: a directory another command has just created
+   is in the cache before that command's batch has written through its
+   fd, and its creator holds only the parent's stripe lock. A dirty
+   directory is only dropped once it has been written: if dirty ones
+   alone keep the cache over budget, a save writes them all, in the
+   order write-back and the journal require. */
+static void dcache_trim(void)
+{
+    if (dcache_budget == 0 || atomic_load(&dcache_bytes) <= dcache_budget) {
+        return;
+    }
+
+    InodeList victims = { NULL, 0, 0 };
+    for (int pass = 0; pass < 2; pass++) {
+        size_t dirty = 0;
+        ns_enter(1);
+
+        /* Two turns of the hand: the first may only clear bits */
+        pthread_mutex_lock(&dcache_lock);
+        size_t steps = 2 * dcache_buckets;
+        pthread_mutex_unlock(&dcache_lock);
+
+        while (steps-- > 0 && atomic_load(&dcache_bytes) > dcache_budget) {
+            victims.n = 0;
+            pthread_mutex_lock(&dcache_lock);
+            dcache_hand = (dcache_hand + 1) & (dcache_buckets - 1);
+            for (Dir *d = dcache[dcache_hand]; d; d = d->next) {
+                if (d->ref) {
+                    d->ref = 0;
+                } else {
+                    inode_list_push(&victims, d->inode);
+                }
+            }
+            pthread_mutex_unlock(&dcache_lock);
+
+            for (size_t i = 0; i < victims.n; i++) {
+                dirty += !dcache_evict(victims.v[i]);
+            }
+        }
+        ns_leave();
+
+        if (pass > 0 || dirty == 0 || !writeback ||
+            atomic_load(&dcache_bytes) <= dcache_budget) {
+            break;
+        }
+        ns_enter(1);
+        save_state();
+        ns_leave();
+    }
+    free(victims.v);
+}
+
+/* A word of a command line: a slice of the line, not NUL-terminated */
+typedef struct {
+    const char *p;
+    size_t len;
+} Token;
+
+/* Take the next blank-separated word of [*pos, end) into t. Returns 0
+   when only blanks are left. The line is not modified. */
+static int next_token(const char **pos, const char *end, Token *t)
+{
+    const char *p = *pos;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p == end) {
+        *pos = p;
+        return 0;
+    }
+
+    t->p = p;
+    while (p < end && *p != ' ' && *p != '\t') {
+        p++;
+    }
+    t->len = (size_t)(p - t->p);
+    *pos = p;
+    return 1;
+}
+
+/* The arguments of a command, NUL-terminated copies of its tokens */
+typedef struct {
+    const char *argv[2];
+    const char *text;  /* rest of the line, for CMD_TEXT */
+    int recursive;     /* rm -r */
+    const char **list; /* every argument, for CMD_MANY */
+    size_t count;
+} CmdArgs;
+
+static int run_ls(Session *s, const CmdArgs *a)
+{
+    (void)a;
+    cmd_ls(s);
+    return 1;
+}
+
+static int run_cd(Session *s, const CmdArgs *a)
+{
+    cmd_cd(s, a->argv[0]);
+    return 1;
+}
+
+static int run_mkdir(Session *s, const CmdArgs *a)
+{
+    cmd_mkdir(s, a->list, a->count);
+    return 1;
+}
+
+static int run_touch(Session *s, const CmdArgs *a)
+{
+    cmd_touch(s, a->list, a->count);
+    return 1;
+}
+
+static int run_rm(Session *s, const CmdArgs *a)
+{
+    cmd_rm(s, a->argv[0], a->recursive);
+    return 1;
+}
+
+static int run_rmdir(Session *s, const CmdArgs *a)
+{
+    cmd_rmdir(s, a->argv[0]);
+    return 1;
+}
+
+static int run_mv(Session *s, const CmdArgs *a)
+{
+    cmd_mv(s, a->argv[0], a->argv[1]);
+    return 1;
+}
+
+static int run_write(Session *s, const CmdArgs *a)
+{
+    cmd_write(s, a->argv[0], a->text, 0);
+    return 1;
+}
+
+static int run_append(Session *s, const CmdArgs *a)
+{
+    cmd_write(s, a->argv[0], a->text, 1);
+    return 1;
+}
+
+static int run_cat(Session *s, const CmdArgs *a)
+{
+    cmd_cat(s, a->argv[0]);
+    return 1;
+}
+
+static int run_stats(Session *s, const CmdArgs *a)
+{
+    (void)a;
+    cmd_stats(s);
+    return 1;
+}
+
+static int run_sync(Session *s, const CmdArgs *a)
+{
+    (void)s;
+    (void)a;
+    cmd_sync();
+    return 1;
+}
+
+static int run_snapshot(Session *s, const CmdArgs *a)
+{
+    cmd_snapshot(s, a->argv[0]);
+    return 1;
+}
+
+static int run_rollback(Session *s, const CmdArgs *a)
+{
+    cmd_rollback(s, a->argv[0]);
+    return 1;
+}
+
+static int run_exit(Session *s, const CmdArgs *a)
+{
+    (void)s;
+    (void)a;
+    return 0;
+}
 
-#define MAX_INODES 1024
-#define NAME_LEN 32
+/* Command flags: the last argument is the rest of the line, a leading -r
+   is accepted, or any number of arguments past nargs is */
+#define CMD_TEXT 1
+#define CMD_RFLAG 2
+#define CMD_MANY 4
 
-/* Stores whether an inode is in use and whether it is a file or directory */
-typedef struct {
-    int used;
-    char type;
-} InodeInfo;
+/* The command table is indexed by a perfect hash of the name's length
+   and first and last characters. Two commands on one slot make the
+   initializer below override an entry, which -Wextra reports. */
+#define CMD_SLOTS 32
+#define CMD_HASH(len, first, last) \
+    ((3u * (len) + 2u * (unsigned char)(first) + (unsigned char)(last)) & (CMD_SLOTS - 1))
+#define CMD(name, len, first, last, nargs, flags, run) \
+    [CMD_HASH(len, first, last)] = { name, len, nargs, flags, run }
 
-/* Represents a directory entry: inode number + fixed-length name */
 typedef struct {
-    uint32_t inode;
-    char name[NAME_LEN];
-} DirEnt;
+    const char *name;
+    unsigned char len;
+    unsigned char nargs;
+    unsigned char flags;
+    int (*run)(Session *s, const CmdArgs *a);  /* 0 ends the session */
+} Command;
 
-/* Table holding metadata for all possible inodes */
-static InodeInfo inode_table[MAX_INODES];
-
-/* Print an error message and exit */
-static void die(const char *msg)
-{
-    fprintf(stderr, "%s\n", msg);
-    exit(1);
-}
+static const Command commands[CMD_SLOTS] = {
+    CMD("ls", 2, 'l', 's', 0, 0, run_ls),
+    CMD("cd", 2, 'c', 'd', 1, 0, run_cd),
+    CMD("mkdir", 5, 'm', 'r', 1, CMD_MANY, run_mkdir),
+    CMD("touch", 5, 't', 'h', 1, CMD_MANY, run_touch),
+    CMD("rm", 2, 'r', 'm', 1, CMD_RFLAG, run_rm),
+    CMD("rmdir", 5, 'r', 'r', 1, 0, run_rmdir),
+    CMD("mv", 2, 'm', 'v', 2, 0, run_mv),
+    CMD("write", 5, 'w', 'e', 1, CMD_TEXT, run_write),
+    CMD("append", 6, 'a', 'd', 1, CMD_TEXT, run_append),
+    CMD("cat", 3, 'c', 't', 1, 0, run_cat),
+    CMD("stats", 5, 's', 's', 0, 0, run_stats),
+    CMD("sync", 4, 's', 'c', 0, 0, run_sync),
+    CMD("snapshot", 8, 's', 't', 1, 0, run_snapshot),
+    CMD("rollback", 8, 'r', 'k', 1, 0, run_rollback),
+    CMD("exit", 4, 'e', 't', 0, 0, run_exit),
+};
 
-/* Check whether a path refers to a directory on the real file system */
-static int is_directory(const char *path)
+static const Command *command_find(const Token *t)
 {
-    struct stat st;
-    if (stat(path, &st) != 0) {
-        return 0;
+    const Command *c = &commands[CMD_HASH(t->len, t->p[0], t->p[t->len - 1])];
+    if (!c->name || c->len != t->len || memcmp(c->name, t->p, t->len) != 0) {
+        return NULL;
     }
-    return S_ISDIR(st.st_mode);
+    return c;
 }
 
-/* Copy a name into a fixed 32-byte buffer, truncating if necessary */
-static void make_name32(char dst[NAME_LEN], const char *src)
+/* Arguments are copied here to NUL-terminate them */
+static _Thread_local char *arg_buf;
+static _Thread_local size_t arg_cap;
+static _Thread_local const char **arg_list;
+static _Thread_local size_t arg_list_cap;
+
+/* Add an argument to arg_list at index i, growing it as needed */
+static void arg_list_set(size_t i, const char *arg)
 {
-    memset(dst, 0, NAME_LEN);
-    strncpy(dst, src, NAME_LEN);
+    if (i >= arg_list_cap) {
+        size_t cap = arg_list_cap ? arg_list_cap * 2 : 16;
+        const char **list = realloc(arg_list, cap * sizeof(char *));
+        if (!list) {
+            die("command: out of memory");
+        }
+        arg_list = list;
+        arg_list_cap = cap;
+    }
+    arg_list[i] = arg;
 }
 
-/* Load inode usage information from the binary inodes_list file */
-static void load_inodes_list(void)
+/* Split a command's arguments off [pos, end) into a, as c expects.
+   Returns 0 if their number is wrong. */
+static int command_args(const Command *c, const char *pos, const char *end, CmdArgs *a)
 {
-    FILE *f = fopen("inodes_list", "rb");
-    if (!f) {
-        perror("inodes_list");
-        exit(1);
+    size_t need = (size_t)(end - pos) + c->nargs + 1;
+    if (need > arg_cap) {
+        char *buf = realloc(arg_buf, need);
+        if (!buf) {
+            die("command: out of memory");
+        }
+        arg_buf = buf;
+        arg_cap = need;
     }
 
-    uint32_t index;
-    char type;
-
-    while (fread(&index, sizeof(uint32_t), 1, f) == 1 &&
-           fread(&type,  sizeof(char),     1, f) == 1) {
+    char *out = arg_buf;
+    Token t;
+    int have = next_token(&pos, end, &t);
+    if (have && (c->flags & CMD_RFLAG) && t.len == 2 && memcmp(t.p, "-r", 2) == 0) {
+        a->recursive = 1;
+        have = next_token(&pos, end, &t);
+    }
 
-        if (index >= MAX_INODES) {
-            fprintf(stderr, "Invalid inode (out of range): %u\n", (unsigned)index);
-            continue;
+    for (int i = 0; i < c->nargs; i++) {
+        if (i > 0) {
+            have = next_token(&pos, end, &t);
         }
-
-        if (type != 'd' && type != 'f') {
-            fprintf(stderr, "Invalid inode type for inode %u\n", (unsigned)index);
-            continue;
+        if (!have) {
+            return 0;
         }
+        memcpy(out, t.p, t.len);
+        out[t.len] = '\0';
+        a->argv[i] = out;
+        out += t.len + 1;
+    }
 
-        inode_table[index].used = 1;
-        inode_table[index].type = type;
+    if (c->flags & CMD_MANY) {
+        size_t n = 0;
+        for (int i = 0; i < c->nargs; i++) {
+            arg_list_set(n++, a->argv[i]);
+        }
+        while (next_token(&pos, end, &t)) {
+            memcpy(out, t.p, t.len);
+            out[t.len] = '\0';
+            arg_list_set(n++, out);
+            out += t.len + 1;
+        }
+        a->list = arg_list;
+        a->count = n;
+        return 1;
     }
 
-    fclose(f);
+    if (c->flags & CMD_TEXT) {
+        while (pos < end && (*pos == ' ' || *pos == '\t')) {
+            pos++;
+        }
+        memcpy(out, pos, (size_t)(end - pos));
+        out[end - pos] = '\0';
+        a->text = out;
+        return 1;
+    }
+    return c->nargs == 0 ? !have : !next_token(&pos, end, &t);
 }
 
-/* Write the current inode table back to inodes_list */
-static void save_inodes_list(void)
+/* Parse and run one command line of len bytes; a newline ends it early.
+   Returns 0 once the session asks to exit. */
+static int run_command(Session *s, const char *line, size_t len)
 {
-    FILE *f = fopen("inodes_list", "wb");
-    if (!f) {
-        perror("inodes_list");
-        return;
+    const char *nl = memchr(line, '\n', len);
+    const char *pos = line, *end = nl ? nl : line + len;
+
+    Token cmd;
+    if (!next_token(&pos, end, &cmd)) return 1;
+
+    /* Another server client may have removed this session's directory */
+    if (s->pin && atomic_load(&s->pin->removed)) {
+        fprintf(s->err, "Current directory was removed, returning to /\n");
+        session_set_cwd(s, 0);
     }
 
-    for (uint32_t i = 0; i < MAX_INODES; i++) {
-        if (inode_table[i].used) {
-            fwrite(&i, sizeof(uint32_t), 1, f);
-            fwrite(&inode_table[i].type, sizeof(char), 1, f);
-        }
+    const Command *c = command_find(&cmd);
+    CmdArgs a = { { NULL, NULL }, "", 0, NULL, 0 };
+    if (!c || !command_args(c, pos, end, &a)) {
+        fprintf(s->err, "Invalid command\n");
+    } else if (!c->run(s, &a)) {
+        return 0;
     }
 
-    fclose(f);
+    commit_command();
+    dcache_trim();
+    return 1;
 }
 
-/* Search a directory for an entry with the given name */
-static int dir_find(uint32_t dir_inode, const char *name, DirEnt *out)
+/* One connection in server mode, with its own session and buffers. While
+   a command runs, its output collects in cmd_out, of which cmd_sent bytes
+   have already gone straight to the socket. */
+typedef struct {
+    int fd;
+    Session s;
+    char *in;
+    size_t in_len, in_cap;
+    char *out;
+    size_t out_len, out_off;
+    char *cmd_out;
+    size_t cmd_len, cmd_sent;
+    struct timespec send_deadline;
+    int closing;
+} Client;
+
+/* Create the listening socket. Done before chdir so relative socket paths
+   are taken relative to where the server was started. */
+static int server_listen(const char *path)
 {
-    char fname[16];
-    snprintf(fname, sizeof(fname), "%u", (unsigned)dir_inode);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
 
-    FILE *f = fopen(fname, "rb");
-    if (!f) {
-        return 0;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
     }
+    strcpy(addr.sun_path, path);
 
-    DirEnt ent;
-    char key[NAME_LEN];
-    make_name32(key, name);
-
-    while (fread(&ent.inode, sizeof(uint32_t), 1, f) == 1 &&
-           fread(ent.name, 1, NAME_LEN, f) == NAME_LEN) {
-
-        if (memcmp(ent.name, key, NAME_LEN) == 0) {
-            if (out) {
-                *out = ent;
-            }
-            fclose(f);
-            return 1;
-        }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
     }
 
-    fclose(f);
-    return 0;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-/* Append a new entry to a directory file */
-static int dir_append(uint32_t dir_inode, uint32_t child_inode, const char *name)
+static void client_free(int epfd, Client *c)
 {
-    char fname[16];
-    snprintf(fname, sizeof(fname), "%u", (unsigned)dir_inode);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    session_set_cwd(&c->s, 0);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
 
-    FILE *f = fopen(fname, "ab");
-    if (!f) {
-        return 0;
-    }
+/* Wait until a client's socket takes more output. A command waits at
+   most SERVER_SEND_WAIT_MS in all; returns 0 once that is used up. */
+static int client_wait_out(Session *s)
+{
+    Client *c = (Client *)((char *)s - offsetof(Client, s));
 
-    char namebuf[NAME_LEN];
-    make_name32(namebuf, name);
+    for (;;) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t ms = (int64_t)(c->send_deadline.tv_sec - now.tv_sec) * 1000 +
+                     (c->send_deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0) {
+            return 0;
+        }
 
-    fwrite(&child_inode, sizeof(uint32_t), 1, f);
-    fwrite(namebuf, 1, NAME_LEN, f);
+        struct pollfd p = { c->fd, POLLOUT, 0 };
+        int r = poll(&p, 1, (int)ms);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        return r > 0 && (p.revents & POLLOUT);
+    }
+}
 
-    fclose(f);
+/* Send buf[*off..len) to a client, waiting while its socket is full.
+   Returns 0 if the client is gone or too slow. */
+static int client_send(Client *c, const char *buf, size_t len, size_t *off)
+{
+    while (*off < len) {
+        ssize_t n = send(c->fd, buf + *off, len - *off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            client_wait_out(&c->s)) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        *off += (size_t)n;
+    }
     return 1;
 }
 
-/* Find the first unused inode number */
-static int find_free_inode(void)
+/* Send a client everything the session has printed so far, so that file
+   contents can follow straight on the socket */
+static int client_drain(Session *s)
 {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (!inode_table[i].used) {
-            return i;
-        }
+    Client *c = (Client *)((char *)s - offsetof(Client, s));
+
+    fflush(s->out);
+    if (!client_send(c, c->out, c->out_len, &c->out_off) ||
+        !client_send(c, c->cmd_out, c->cmd_len, &c->cmd_sent)) {
+        return -1;
     }
-    return -1;
+    c->out_off = 0;
+    c->out_len = 0;
+    return c->fd;
 }
 
-/* Create a directory inode file containing . and .. */
-static int create_dir_inode(uint32_t new_inode, uint32_t parent_inode)
+/* Run one line for a client, capturing everything it prints that does
+   not go straight to the socket */
+static void client_exec(Client *c, const char *line, size_t line_len)
 {
-    char fname[16];
-    snprintf(fname, sizeof(fname), "%u", (unsigned)new_inode);
+    c->cmd_out = NULL;
+    c->cmd_len = 0;
+    c->cmd_sent = 0;
+    FILE *m = open_memstream(&c->cmd_out, &c->cmd_len);
+    if (!m) {
+        c->closing = 1;
+        return;
+    }
 
-    FILE *f = fopen(fname, "wb");
-    if (!f) {
-        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &c->send_deadline);
+    c->send_deadline.tv_sec += SERVER_SEND_WAIT_MS / 1000;
+    c->send_deadline.tv_nsec += (SERVER_SEND_WAIT_MS % 1000) * 1000000L;
+    if (c->send_deadline.tv_nsec >= 1000000000L) {
+        c->send_deadline.tv_sec++;
+        c->send_deadline.tv_nsec -= 1000000000L;
     }
 
-    char dot[NAME_LEN], dotdot[NAME_LEN];
-    make_name32(dot, ".");
-    make_name32(dotdot, "..");
+    c->s.out = m;
+    c->s.err = m;
+    c->s.drain = client_drain;
+    c->s.wait_out = client_wait_out;
+    if (!run_command(&c->s, line, line_len)) {
+        ns_enter(1);
+        save_state();
+        ns_leave();
+        c->closing = 1;
+    }
+    fclose(m);
 
-    fwrite(&new_inode, sizeof(uint32_t), 1, f);
-    fwrite(dot, 1, NAME_LEN, f);
+    size_t len = c->cmd_len - c->cmd_sent;
+    if (len > 0) {
+        char *out = realloc(c->out, c->out_len + len);
+        if (!out) {
+            c->closing = 1;
+        } else {
+            memcpy(out + c->out_len, c->cmd_out + c->cmd_sent, len);
+            c->out = out;
+            c->out_len += len;
+        }
+    }
+    free(c->cmd_out);
+    c->cmd_out = NULL;
+}
 
-    fwrite(&parent_inode, sizeof(uint32_t), 1, f);
-    fwrite(dotdot, 1, NAME_LEN, f);
+/* Send as much pending output as the socket takes. Returns -1 when the
+   client is gone, 0 while output remains and 1 once it is all sent. */
+static int client_flush(Client *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        c->out_off += (size_t)n;
+    }
 
-    fclose(f);
+    c->out_off = 0;
+    c->out_len = 0;
     return 1;
 }
 
-/* Create a file inode and write the name into it */
-static int create_file_inode(uint32_t new_inode, const char *name)
+/* Read what a client sent and run every complete line. Returns 0 on EOF
+   or error. */
+static int client_read(Client *c)
 {
-    char fname[16];
-    snprintf(fname, sizeof(fname), "%u", (unsigned)new_inode);
+    for (;;) {
+        if (c->in_cap - c->in_len < 4096) {
+            size_t cap = c->in_cap ? c->in_cap * 2 : 8192;
+            char *in = realloc(c->in, cap);
+            if (!in) {
+                return 0;
+            }
+            c->in = in;
+            c->in_cap = cap;
+        }
 
-    FILE *f = fopen(fname, "wb");
-    if (!f) {
-        return 0;
-    }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        c->in_len += (size_t)n;
 
-    char namebuf[NAME_LEN];
-    make_name32(namebuf, name);
+        size_t start = 0;
+        char *nl;
+        while (!c->closing &&
+               (nl = memchr(c->in + start, '\n', c->in_len - start)) != NULL) {
+            client_exec(c, c->in + start, (size_t)(nl - (c->in + start)));
+            start = (size_t)(nl - c->in) + 1;
+        }
+        memmove(c->in, c->in + start, c->in_len - start);
+        c->in_len -= start;
 
-    size_t n = 0;
-    while (n < NAME_LEN && namebuf[n] != '\0') {
-        n++;
+        if (c->closing) {
+            return 1;
+        }
+        if (c->in_len > SERVER_MAX_LINE) {
+            return 0;
+        }
     }
+}
 
-    fwrite(namebuf, 1, n, f);
-    fclose(f);
-    return 1;
+/* Shared by the threads of a running server */
+typedef struct {
+    int epfd;
+    int lfd;
+    int stop_fd;
+} Server;
+
+/* Marks the stop pipe's epoll registration; clients use their Client */
+static char stop_marker;
+static int stop_pipe[2] = { -1, -1 };
+
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    char b = 0;
+    ssize_t r = write(stop_pipe[1], &b, 1);
+    (void)r;
 }
 
-/* Print the contents of the current directory */
-static void cmd_ls(uint32_t cwd)
+/* Accept every pending connection */
+static void server_accept(Server *srv)
 {
-    char fname[16];
-    snprintf(fname, sizeof(fname), "%u", (unsigned)cwd);
+    struct epoll_event ev;
+    int fd;
 
-    FILE *f = fopen(fname, "rb");
-    if (!f) {
-        perror("ls");
-        return;
+    while ((fd = accept4(srv->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        Client *c = calloc(1, sizeof(Client));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->s.cwd = 0;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = c;
+        epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev);
     }
 
-    DirEnt ent;
-    char namebuf[NAME_LEN + 1];
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    epoll_ctl(srv->epfd, EPOLL_CTL_MOD, srv->lfd, &ev);
+}
 
-    while (fread(&ent.inode, sizeof(uint32_t), 1, f) == 1 &&
-           fread(ent.name, 1, NAME_LEN, f) == NAME_LEN) {
+/* One server thread. All threads wait on the same epoll set; every fd is
+   registered one-shot, so a client is only ever handled by one thread at
+   a time and is re-armed once that thread is done with it. */
+static void *server_loop(void *arg)
+{
+    Server *srv = arg;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    struct epoll_event ev;
 
-        memcpy(namebuf, ent.name, NAME_LEN);
-        namebuf[NAME_LEN] = '\0';
-        printf("%u %s\n", (unsigned)ent.inode, namebuf);
-    }
+    for (;;) {
+        int n = epoll_wait(srv->epfd, events, SERVER_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return NULL;
+        }
 
-    fclose(f);
+        for (int i = 0; i < n; i++) {
+            Client *c = events[i].data.ptr;
+
+            if ((char *)c == &stop_marker) {
+                return NULL;
+            }
+
+            if (!c) {
+                server_accept(srv);
+                continue;
+            }
+
+            int alive = 1;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                alive = client_read(c);
+            }
+
+            int sent = client_flush(c);
+            if (!alive || sent < 0 || (sent == 1 && c->closing)) {
+                client_free(srv->epfd, c);
+                continue;
+            }
+
+            ev.events = EPOLLONESHOT | (sent == 0 ? EPOLLOUT : 0) |
+                        (c->closing ? 0 : EPOLLIN);
+            ev.data.ptr = c;
+            epoll_ctl(srv->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    }
 }
 
-/* Change the current working directory */
-static void cmd_cd(uint32_t *cwd, const char *name)
+/* Serve clients on nthreads threads until SIGINT/SIGTERM */
+static void server_run(int lfd, const char *path, int nthreads)
 {
-    DirEnt ent;
-
-    if (!dir_find(*cwd, name, &ent)) {
-        fprintf(stderr, "cd: no such directory\n");
+    Server srv;
+    srv.lfd = lfd;
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv.epfd < 0 || pipe2(stop_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("server");
         return;
     }
+    srv.stop_fd = stop_pipe[0];
 
-    if (ent.inode >= MAX_INODES || !inode_table[ent.inode].used ||
-        inode_table[ent.inode].type != 'd') {
-        fprintf(stderr, "cd: not a directory\n");
-        return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    epoll_ctl(srv.epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    /* Level-triggered and never drained, so it wakes every thread */
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop_marker;
+    epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.stop_fd, &ev);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pthread_t *tids = calloc((size_t)nthreads, sizeof(pthread_t));
+    int started = 0;
+    while (tids && started < nthreads - 1 &&
+           pthread_create(&tids[started], NULL, server_loop, &srv) == 0) {
+        started++;
+    }
+
+    server_loop(&srv);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
     }
+    free(tids);
 
-    *cwd = ent.inode;
+    close(srv.epfd);
+    close(lfd);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    unlink(path);
 }
 
-/* Create a new directory in the current directory */
-static void cmd_mkdir(uint32_t cwd, const char *name)
+/* --verify: check the inode list and every directory file against the
+   checksums file, changing nothing. Returns the exit status. */
+static int verify_image(void)
 {
-    if (dir_find(cwd, name, NULL)) {
-        fprintf(stderr, "mkdir: already exists\n");
-        return;
+    if (!sums_load()) {
+        fprintf(stderr, "verify: no usable checksums file\n");
+        return 1;
     }
 
-    int free_i = find_free_inode();
-    if (free_i < 0) {
-        fprintf(stderr, "mkdir: no free inodes\n");
-        return;
+    uint32_t sum;
+    if (!read_inodes_list("inodes_list", &inode_used_set, &inode_dir_set, &sum)) {
+        return 1;
+    }
+
+    unsigned bad = 0;
+    if (sum != ilist_sum) {
+        printf("inodes_list: checksum mismatch\n");
+        bad++;
     }
 
-    inode_table[free_i].used = 1;
-    inode_table[free_i].type = 'd';
+    size_t dirs = 0, unsummed = 0;
+    uint64_t pos = 0;
+    uint32_t inode;
+    while (iset_next(&inode_dir_set, &pos, &inode)) {
+        char *buf;
+        size_t len;
+        dirs++;
+        if (!io_read_file(inode, &buf, &len)) {
+            printf("directory %u: %s\n", (unsigned)inode, strerror(errno));
+            bad++;
+            continue;
+        }
 
-    if (!create_dir_inode((uint32_t)free_i, cwd) ||
-        !dir_append(cwd, (uint32_t)free_i, name)) {
-        inode_table[free_i].used = 0;
+        int legacy;
+        size_t n;
+        DirSum *ds = dir_sum_find(inode);
+        if (!ds) {
+            unsummed++;
+        } else if (ds->sum != crc32c(0, buf, dir_file_scan(buf, len, &legacy, &n))) {
+            printf("directory %u: checksum mismatch\n", (unsigned)inode);
+            bad++;
+        }
+        free(buf);
     }
+
+    printf("verify: %zu directories, %u errors, %zu without a checksum\n", dirs, bad, unsummed);
+    return bad ? 1 : 0;
 }
 
-/* Create a new file in the current directory */
-static void cmd_touch(uint32_t cwd, const char *name)
+/* Input of the REPL, read in large blocks. Lines are handed out as
+   slices of the buffer; a line that does not fit moves to the front and
+   the buffer doubles. scanned counts the bytes of the partial line that
+   hold no newline, so long lines are searched once. */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t cap, len, start, scanned;
+    int eof;
+} LineReader;
+
+/* Return the next line, without its newline, in *line and *len. The
+   slice stays valid until the next call. Returns 0 at end of input; a
+   last line without a newline is still returned. */
+static int read_line(LineReader *r, const char **line, size_t *len)
 {
-    if (dir_find(cwd, name, NULL)) {
-        return;
-    }
+    for (;;) {
+        size_t seen = r->start + r->scanned;
+        char *nl = r->len > seen ? memchr(r->buf + seen, '\n', r->len - seen) : NULL;
+        if (nl) {
+            *line = r->buf + r->start;
+            *len = (size_t)(nl - *line);
+            r->start = (size_t)(nl - r->buf) + 1;
+            r->scanned = 0;
+            return 1;
+        }
+        r->scanned = r->len - r->start;
 
-    int free_i = find_free_inode();
-    if (free_i < 0) {
-        fprintf(stderr, "touch: no free inodes\n");
-        return;
-    }
+        if (r->eof) {
+            if (r->scanned == 0) {
+                return 0;
+            }
+            *line = r->buf + r->start;
+            *len = r->scanned;
+            r->start = r->len;
+            r->scanned = 0;
+            return 1;
+        }
+
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->len - r->start);
+            r->len -= r->start;
+            r->start = 0;
+        }
+        if (r->len == r->cap) {
+            size_t cap = r->cap ? r->cap * 2 : INPUT_BLOCK;
+            char *buf = realloc(r->buf, cap);
+            if (!buf) {
+                die("input: out of memory");
+            }
+            r->buf = buf;
+            r->cap = cap;
+        }
 
-    inode_table[free_i].used = 1;
-    inode_table[free_i].type = 'f';
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            r->eof = 1;
+        } else {
+            r->len += (size_t)n;
+        }
+    }
+}
 
-    if (!create_file_inode((uint32_t)free_i, name) ||
-        !dir_append(cwd, (uint32_t)free_i, name)) {
-        inode_table[free_i].used = 0;
+/* Parse an option's decimal value, which may be at most max */
+static int parse_number(const char *arg, unsigned long long max, unsigned long long *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (arg[0] < '0' || arg[0] > '9' || *end != '\0' || errno || n > max) {
+        return 0;
     }
+    *out = n;
+    return 1;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <fs_directory>\n", argv[0]);
+    const char *sock_path = NULL;
+    int nthreads = 0;
+    int verify = 0;
+    int argi = 1;
+
+    while (argi < argc - 1) {
+        if (strcmp(argv[argi], "--writeback") == 0) {
+            writeback = 1;
+            argi++;
+            continue;
+        }
+        if (strcmp(argv[argi], "--uring") == 0) {
+            use_uring = 1;
+            argi++;
+            continue;
+        }
+        if (strcmp(argv[argi], "--verify") == 0) {
+            verify = 1;
+            argi++;
+            continue;
+        }
+        if (argi == argc - 2) {
+            break;
+        }
+        if (strcmp(argv[argi], "--server") == 0) {
+            sock_path = argv[argi + 1];
+        } else if (strcmp(argv[argi], "--durability") == 0) {
+            const char *mode = argv[argi + 1];
+            if (strcmp(mode, "none") == 0) {
+                durability = DUR_NONE;
+            } else if (strcmp(mode, "interval") == 0) {
+                durability = DUR_INTERVAL;
+            } else if (strcmp(mode, "command") == 0) {
+                durability = DUR_COMMAND;
+            } else {
+                break;
+            }
+        } else if (strcmp(argv[argi], "--inodes-list") == 0) {
+            const char *format = argv[argi + 1];
+            if (strcmp(format, "v1") == 0) {
+                ilist_version = 1;
+            } else if (strcmp(format, "v2") == 0) {
+                ilist_version = 2;
+            } else {
+                break;
+            }
+        } else if (strcmp(argv[argi], "--dir-format") == 0) {
+            const char *format = argv[argi + 1];
+            if (strcmp(format, "v1") == 0) {
+                dir_version = 1;
+            } else if (strcmp(format, "v2") == 0) {
+                dir_version = 2;
+            } else {
+                break;
+            }
+        } else if (strcmp(argv[argi], "--dir-cache") == 0) {
+            unsigned long long mb;
+            if (!parse_number(argv[argi + 1], SIZE_MAX >> 20, &mb)) {
+                break;
+            }
+            dcache_budget = (size_t)mb << 20;
+        } else if (strcmp(argv[argi], "--threads") == 0) {
+            unsigned long long n;
+            if (!parse_number(argv[argi + 1], SERVER_MAX_THREADS, &n) || n == 0) {
+                break;
+            }
+            nthreads = (int)n;
+        } else {
+            break;
+        }
+        argi += 2;
+    }
+
+    /* --threads only means something to a server */
+    if (argi != argc - 1 || (nthreads && !sock_path)) {
+        fprintf(stderr, "Usage: %s [--verify] [--writeback] [--uring] "
+                "[--durability none|interval|command] [--inodes-list v1|v2] [--dir-format v1|v2] "
+                "[--dir-cache <MiB>] [--server <socket> [--threads <n>]] <fs_directory>\n", argv[0]);
         return 1;
     }
 
-    if (!is_directory(argv[1])) {
-        fprintf(stderr, "Not a directory: %s\n", argv[1]);
+    const char *fs_dir = argv[argi];
+
+    if (!is_directory(fs_dir)) {
+        fprintf(stderr, "Not a directory: %s\n", fs_dir);
         return 1;
     }
 
-    if (chdir(argv[1]) != 0) {
+    int lfd = -1;
+    char sock_abs[4096];
+    if (sock_path) {
+        lfd = server_listen(sock_path);
+        if (lfd < 0) {
+            return 1;
+        }
+
+        /* Keep a path that still names the socket after the chdir below */
+        if (sock_path[0] == '/' || !getcwd(sock_abs, sizeof(sock_abs) - strlen(sock_path) - 1)) {
+            snprintf(sock_abs, sizeof(sock_abs), "%s", sock_path);
+        } else {
+            strcat(sock_abs, "/");
+            strcat(sock_abs, sock_path);
+        }
+    }
+
+    if (chdir(fs_dir) != 0) {
         perror("chdir");
         return 1;
     }
 
-    memset(inode_table, 0, sizeof(inode_table));
+    if (verify) {
+        return verify_image();
+    }
+
+    if (durability != DUR_NONE) {
+        writeback = 1;
+        root_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd < 0) {
+            perror("open");
+            return 1;
+        }
+    }
+
+    static char crash_buf[32];
+    const char *crash = getenv("FS_EMULATOR_CRASH");
+    if (crash) {
+        snprintf(crash_buf, sizeof(crash_buf), "%s", crash);
+        char *count = strchr(crash_buf, ':');
+        if (count) {
+            *count++ = '\0';
+        }
+        crash_point = crash_buf;
+        crash_countdown = count ? atoi(count) : 1;
+    }
+
+    locks_init();
+    names_reset();
+    sums_load();
     load_inodes_list();
+    load_extents();
+    snap_load();
 
-    if (!inode_table[0].used || inode_table[0].type != 'd') {
+    if (!inode_used(0) || inode_type(0) != 'd') {
         die("inode 0 is not a directory");
     }
 
-    uint32_t cwd = 0;
-    char line[256];
-
-    while (1) {
-        if (!fgets(line, sizeof(line), stdin)) {
-            save_inodes_list();
-            break;
+    if (durability != DUR_NONE) {
+        wal_open();
+        wal_on = 1;
+        if (wal_sweep) {
+            recover_tree();
         }
+    }
 
-        line[strcspn(line, "\n")] = '\0';
+    if (writeback && durability != DUR_COMMAND) {
+        wb_start();
+    }
+
+    if (lfd >= 0) {
+        server_run(lfd, sock_abs, nthreads ? nthreads : 1);
+        wb_shutdown();
+        save_state();
+        return 0;
+    }
 
-        char *cmd = strtok(line, " \t");
-        if (!cmd) continue;
-
-        if (strcmp(cmd, "ls") == 0) {
-            char *extra = strtok(NULL, " \t");
-            if (extra) fprintf(stderr, "Invalid command\n");
-            else cmd_ls(cwd);
-
-        } else if (strcmp(cmd, "cd") == 0) {
-            char *arg = strtok(NULL, " \t");
-            char *extra = strtok(NULL, " \t");
-            if (!arg || extra) fprintf(stderr, "Invalid command\n");
-            else cmd_cd(&cwd, arg);
-
-        } else if (strcmp(cmd, "mkdir") == 0) {
-            char *arg = strtok(NULL, " \t");
-            char *extra = strtok(NULL, " \t");
-            if (!arg || extra) fprintf(stderr, "Invalid command\n");
-            else cmd_mkdir(cwd, arg);
-
-        } else if (strcmp(cmd, "touch") == 0) {
-            char *arg = strtok(NULL, " \t");
-            char *extra = strtok(NULL, " \t");
-            if (!arg || extra) fprintf(stderr, "Invalid command\n");
-            else cmd_touch(cwd, arg);
-
-        } else if (strcmp(cmd, "exit") == 0) {
-            char *extra = strtok(NULL, " \t");
-            if (extra) fprintf(stderr, "Invalid command\n");
-            else { save_inodes_list(); break; }
+    Session s = { 0, NULL, stdout, stderr, NULL, NULL };
+    LineReader in = { STDIN_FILENO, NULL, 0, 0, 0, 0, 0 };
+    const char *line;
+    size_t len;
 
-        } else {
-            fprintf(stderr, "Invalid command\n");
+    while (read_line(&in, &line, &len)) {
+        if (!run_command(&s, line, len)) {
+            break;
         }
     }
+    free(in.buf);
 
+    wb_shutdown();
+    save_state();
     return 0;
 }
-
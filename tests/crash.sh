@@ -0,0 +1,139 @@
+#!/bin/sh
+# Crash recovery test. For each durable mode, commit stage and count n,
+# run the script below on a copy of fs/ with FS_EMULATOR_CRASH=stage:n,
+# which kills the emulator right after the n-th time it passes that
+# stage, then start it again to recover and check that --verify finds no
+# errors and that the tree holds exactly what the first k commands of
+# the script leave behind, for some k.
+#
+#     sh tests/crash.sh [emulator]
+
+EMU=${1:-./fs_emulator}
+STAGES="journal checkpoint files entries lists lists-written"
+COUNTS="1 2 3 5 9 17"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+cat > "$tmp/script" <<'EOF'
+mkdir a b c
+write top first file
+cd a
+mkdir x y z
+write f hello
+append f  world
+touch g h i
+mv g g2
+sync
+cd x
+write deep one
+append deep  two
+mkdir w
+cd ..
+rm h
+rmdir z
+cd ..
+append top  again
+mkdir d e
+touch b1 b2 b3
+rm b2
+cd b
+write inb a file in b
+touch n1 n2 n3 n4 n5 n6
+rm n3
+sync
+cd ..
+rm -r c
+write top rewritten
+mv top top2
+cd a
+write f replaced
+rmdir y
+cd x
+rm deep
+touch after
+cd ..
+cd ..
+mkdir last
+EOF
+lines=$(wc -l < "$tmp/script")
+
+# The commands that take a session from the root to a directory
+cds()
+{
+    [ -n "$1" ] && printf '%s\n' "$1" | tr '/' '\n' | sed 's/^/cd /'
+}
+
+# Print every directory and file under $2 of image $1, files with their
+# contents, in name order and without inode numbers
+dump_dir()
+{
+    names=$({ cds "$2"; echo ls; } | "$EMU" "$1" 2>/dev/null |
+            awk '$2 != "." && $2 != ".." { print $2 }' | sort)
+    for name in $names; do
+        path=${2:+$2/}$name
+        if [ -z "$(cds "$path" | "$EMU" "$1" 2>&1)" ]; then
+            echo "dir $path"
+            (dump_dir "$1" "$path")
+        else
+            echo "file $path"
+            { cds "$2"; echo "cat $name"; } | "$EMU" "$1" 2>&1 | sed 's/^/    /'
+        fi
+    done
+}
+
+# The tree after each prefix of the script, run without any crash
+k=0
+while [ "$k" -le "$lines" ]; do
+    rm -rf "$tmp/img"
+    cp -r fs "$tmp/img"
+    head -n "$k" "$tmp/script" | "$EMU" "$tmp/img" > /dev/null 2>&1
+    dump_dir "$tmp/img" "" > "$tmp/prefix.$k"
+    k=$((k + 1))
+done
+
+runs=0 crashed=0 failed=0
+for mode in command interval; do
+    for stage in $STAGES; do
+        for n in $COUNTS; do
+            rm -rf "$tmp/img"
+            cp -r fs "$tmp/img"
+            runs=$((runs + 1))
+
+            FS_EMULATOR_CRASH=$stage:$n "$EMU" --durability $mode "$tmp/img" \
+                < "$tmp/script" > /dev/null 2>&1
+            status=$?
+            if [ "$status" -eq 99 ]; then
+                crashed=$((crashed + 1))
+            elif [ "$status" -ne 0 ]; then
+                echo "$mode $stage:$n: exited with $status"
+                failed=$((failed + 1))
+                continue
+            fi
+
+            echo ls | "$EMU" --durability $mode "$tmp/img" > /dev/null 2>&1
+            verify=$("$EMU" --verify "$tmp/img" 2>&1 | tail -n 1)
+            case $verify in
+            *" 0 errors"*) ;;
+            *)
+                echo "$mode $stage:$n: $verify"
+                failed=$((failed + 1))
+                continue
+                ;;
+            esac
+
+            dump_dir "$tmp/img" "" > "$tmp/crashed"
+            k=0
+            while [ "$k" -le "$lines" ] && ! cmp -s "$tmp/crashed" "$tmp/prefix.$k"; do
+                k=$((k + 1))
+            done
+            if [ "$k" -gt "$lines" ]; then
+                echo "$mode $stage:$n: tree matches no prefix of the script"
+                failed=$((failed + 1))
+            fi
+        done
+    done
+done
+
+echo "$runs runs, $crashed crashed, $failed failed"
+[ "$failed" -eq 0 ]